@@ -0,0 +1,1092 @@
+#if __linux__
+	#define _GNU_SOURCE
+#endif
+
+#include <iar.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h> // for the MIN & MAX macros
+#include <sys/stat.h>
+
+// benchmarks libiar on synthetic trees, generated from scratch each run so that results are comparable between runs on the same machine
+// results are printed to stdout as tab-separated values, one line per tree, I/O backend & benchmark (see 'print_header')
+// nothing is done to drop the page cache beforehand, so these are warm-cache numbers
+
+static uint64_t scale = 1; // multiplies the size of every tree
+static uint64_t repeat = 3; // times to pack & unpack each tree
+static uint64_t max_samples = 10000; // most files to find, read & map in each tree
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// synthetic tree generators
+// file content is a fixed pattern, so the same tree always packs to the same archive
+
+static uint8_t pattern[1 << 20];
+
+static int write_file(int dir_fd, const char* name, uint64_t bytes) {
+	int const fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		fprintf(stderr, "ERROR Failed to create '%s' (%s)\n", name, strerror(errno));
+		return -1;
+	}
+
+	for (uint64_t done = 0; done < bytes;) {
+		ssize_t const rv = write(fd, pattern, MIN(bytes - done, sizeof pattern));
+
+		if (rv <= 0) {
+			fprintf(stderr, "ERROR Failed to write to '%s' (%s)\n", name, strerror(errno));
+			close(fd);
+
+			return -1;
+		}
+
+		done += rv;
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int gen_tiny(int dir_fd) { // lots of tiny files spread over directories of 100 each
+	char name[32];
+
+	for (uint64_t i = 0; i < scale * 20; i++) {
+		snprintf(name, sizeof name, "d%lu", i);
+
+		if (mkdirat(dir_fd, name, 0755) < 0) {
+			fprintf(stderr, "ERROR Failed to create directory '%s' (%s)\n", name, strerror(errno));
+			return -1;
+		}
+
+		int const sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+
+		if (sub_fd < 0) {
+			fprintf(stderr, "ERROR Failed to open directory '%s' (%s)\n", name, strerror(errno));
+			return -1;
+		}
+
+		for (uint64_t j = 0; j < 100; j++) {
+			snprintf(name, sizeof name, "f%lu", j);
+
+			if (write_file(sub_fd, name, 1 + (i * 100 + j) * 37 % 256) < 0) {
+				close(sub_fd);
+				return -1;
+			}
+		}
+
+		close(sub_fd);
+	}
+
+	return 0;
+}
+
+static int gen_wide(int dir_fd) { // one flat directory with lots of small files
+	char name[32];
+
+	for (uint64_t i = 0; i < scale * 5000; i++) {
+		snprintf(name, sizeof name, "file%lu", i);
+
+		if (write_file(dir_fd, name, 64) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int gen_deep(int dir_fd) { // a long chain of directories, each with a small file
+	int fd = dup(dir_fd);
+
+	for (uint64_t i = 0; i < scale * 200; i++) {
+		if (write_file(fd, "file", 16) < 0) {
+			goto error;
+		}
+
+		if (mkdirat(fd, "d", 0755) < 0) {
+			fprintf(stderr, "ERROR Failed to create directory (%s)\n", strerror(errno));
+			goto error;
+		}
+
+		int const sub_fd = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+
+		if (sub_fd < 0) {
+			fprintf(stderr, "ERROR Failed to open directory (%s)\n", strerror(errno));
+			goto error;
+		}
+
+		close(fd);
+		fd = sub_fd;
+	}
+
+	close(fd);
+	return 0;
+
+error:
+
+	close(fd);
+	return -1;
+}
+
+static int gen_huge(int dir_fd) { // a couple of big files
+	if (write_file(dir_fd, "huge1", scale * 32 << 20) < 0) {
+		return -1;
+	}
+
+	return write_file(dir_fd, "huge2", scale * 32 << 20);
+}
+
+static int gen_sparse(int dir_fd) { // a big file which is mostly holes, with a bit of data every 16 MiB
+	int const fd = openat(dir_fd, "sparse", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		fprintf(stderr, "ERROR Failed to create sparse file (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	uint64_t const bytes = scale * 256 << 20;
+
+	if (ftruncate(fd, bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to truncate sparse file (%s)\n", strerror(errno));
+		close(fd);
+
+		return -1;
+	}
+
+	for (uint64_t offset = 0; offset < bytes; offset += 16 << 20) {
+		if (pwrite(fd, pattern, 64 << 10, offset) < 0) {
+			fprintf(stderr, "ERROR Failed to write to sparse file (%s)\n", strerror(errno));
+			close(fd);
+
+			return -1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+typedef struct {
+	const char* name;
+	int (*gen)(int dir_fd);
+} tree_t;
+
+static tree_t const trees[] = {
+	{ "tiny", gen_tiny },
+	{ "wide", gen_wide },
+	{ "deep", gen_deep },
+	{ "huge", gen_huge },
+	{ "sparse", gen_sparse },
+};
+
+#define TREE_COUNT (sizeof trees / sizeof *trees)
+
+typedef struct {
+	const char* name;
+	const iar_io_t* io;
+} backend_t;
+
+static backend_t const backends[] = {
+	{ "pread", &iar_io_pread },
+	{ "mmap", &iar_io_mmap },
+#if defined(__linux__)
+	{ "uring", &iar_io_uring },
+#endif
+};
+
+#define BACKEND_COUNT (sizeof backends / sizeof *backends)
+
+static int remove_cb(const char* path, const struct stat* sb, int type, struct FTW* ftw) {
+	(void) sb;
+	(void) type;
+	(void) ftw;
+
+	return remove(path);
+}
+
+static void remove_tree(const char* path) {
+	nftw(path, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// results
+// each sample is the time taken by a single operation (a whole pack or unpack, or finding, reading or mapping a single file)
+
+typedef struct {
+	char key[64]; // "<tree>\t<backend>\t<benchmark>"
+	double p50_us;
+} baseline_t;
+
+static baseline_t* baseline = NULL;
+static size_t baseline_count = 0;
+
+static int load_baseline(const char* path) {
+	FILE* const fp = fopen(path, "r");
+
+	if (!fp) {
+		fprintf(stderr, "ERROR Failed to open baseline '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[512];
+
+	while (fgets(line, sizeof line, fp)) {
+		char tree[16], io[16], bench[16];
+		double p50_us;
+
+		// the header doesn't match, as its count isn't a number
+
+		if (sscanf(line, "%15s\t%15s\t%15s\t%*u\t%*f\t%*s\t%*f\t%lf", tree, io, bench, &p50_us) != 4) {
+			continue;
+		}
+
+		baseline = realloc(baseline, (baseline_count + 1) * sizeof *baseline);
+		baseline_t* const entry = &baseline[baseline_count++];
+
+		snprintf(entry->key, sizeof entry->key, "%s\t%s\t%s", tree, io, bench);
+		entry->p50_us = p50_us;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void print_header(void) {
+	printf("tree\tio\tbench\tcount\ttotal_ms\tMiB/s\tops/s\tp50_us\tp90_us\tp99_us\tmax_us\tsyscalls/op%s\n", baseline ? "\tp50_vs_baseline" : "");
+}
+
+static int sample_cmp(const void* _a, const void* _b) {
+	uint64_t const a = *(const uint64_t*) _a;
+	uint64_t const b = *(const uint64_t*) _b;
+
+	return (a > b) - (a < b);
+}
+
+static double percentile_us(uint64_t* samples, size_t count, int percent) {
+	return samples[(count - 1) * percent / 100] / 1000.;
+}
+
+static void report(const char* tree, const char* io, const char* bench, uint64_t* samples, size_t count, uint64_t bytes, uint64_t syscalls) { // 'bytes' is the total amount of file data gone through by all samples
+	if (!count) {
+		return;
+	}
+
+	uint64_t total_ns = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		total_ns += samples[i];
+	}
+
+	qsort(samples, count, sizeof *samples, sample_cmp);
+
+	double const total_s = MAX(total_ns, 1) / 1e9;
+	char throughput[32] = "-";
+
+	if (bytes) {
+		snprintf(throughput, sizeof throughput, "%.1f", bytes / total_s / (1 << 20));
+	}
+
+	double const p50_us = percentile_us(samples, count, 50);
+
+	printf("%s\t%s\t%s\t%zu\t%.3f\t%s\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f",
+		tree, io, bench, count, total_ns / 1e6, throughput, count / total_s,
+		p50_us, percentile_us(samples, count, 90), percentile_us(samples, count, 99), samples[count - 1] / 1000.,
+		(double) syscalls / count);
+
+	if (baseline) {
+		char key[64];
+		snprintf(key, sizeof key, "%s\t%s\t%s", tree, io, bench);
+
+		char ratio[32] = "-";
+
+		for (size_t i = 0; i < baseline_count; i++) {
+			if (!strcmp(baseline[i].key, key)) {
+				snprintf(ratio, sizeof ratio, "%.2fx", baseline[i].p50_us / MAX(p50_us, 0.001));
+				break;
+			}
+		}
+
+		printf("\t%s", ratio);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+// files in an archive, along with the directory they're in, for finding, reading & mapping
+
+typedef struct {
+	char* path;
+	iar_node_t node;
+	iar_node_t parent;
+} file_t;
+
+typedef struct {
+	file_t* files;
+	size_t count;
+} file_list_t;
+
+static int collect_files(iar_file_t* iar, iar_node_t* dir_node, const char* path, file_list_t* list) {
+	iar_dir_t dir;
+
+	if (iar_opendir(iar, &dir, dir_node) < 0) {
+		return -1;
+	}
+
+	iar_dirent_t* dirent;
+
+	while ((dirent = iar_readdir(&dir))) {
+		size_t const path_bytes = strlen(path) + strlen(dirent->name) + 2;
+		char* const child_path = malloc(path_bytes);
+		snprintf(child_path, path_bytes, "%s%s%s", path, *path ? "/" : "", dirent->name);
+
+		if (dirent->node.is_dir) {
+			int const rv = collect_files(iar, &dirent->node, child_path, list);
+			free(child_path);
+
+			if (rv < 0) {
+				break;
+			}
+
+			continue;
+		}
+
+		list->files = realloc(list->files, (list->count + 1) * sizeof *list->files);
+		file_t* const file = &list->files[list->count++];
+
+		file->path = child_path;
+		file->node = dirent->node;
+		file->parent = *dir_node;
+	}
+
+	int const rv = -(dir.index < dir.node_count);
+
+	iar_closedir(&dir);
+	return rv;
+}
+
+static void free_files(file_list_t* list) {
+	for (size_t i = 0; i < list->count; i++) {
+		free(list->files[i].path);
+	}
+
+	free(list->files);
+	list->files = NULL;
+	list->count = 0;
+}
+
+// benchmarks
+
+static int bench_pack(const char* tree, backend_t const* backend, const char* src, const char* output) {
+	uint64_t* const samples = calloc(repeat, sizeof *samples);
+	uint64_t bytes = 0;
+	uint64_t syscalls = 0;
+
+	int rv = -1;
+
+	for (uint64_t i = 0; i < repeat; i++) {
+		iar_file_t iar = { 0 };
+
+		uint64_t const start = now_ns();
+
+		if (iar_open_write(&iar, output) < 0) {
+			goto error;
+		}
+
+		if (iar_set_io(&iar, backend->io) < 0 || iar_pack(&iar, src, NULL) < 0 || iar_write_header(&iar) < 0) {
+			iar_close(&iar);
+			goto error;
+		}
+
+		iar_close(&iar);
+
+		samples[i] = now_ns() - start;
+		syscalls += iar.stats.syscalls;
+
+		uint64_t entries;
+
+		if (iar_open_read(&iar, output) < 0 || iar_node_totals(&iar, &iar.root_node, &bytes, &entries) < 0) {
+			iar_close(&iar);
+			goto error;
+		}
+
+		iar_close(&iar);
+	}
+
+	report(tree, backend->name, "pack", samples, repeat, bytes * repeat, syscalls);
+	rv = 0;
+
+error:
+
+	free(samples);
+	return rv;
+}
+
+static int bench_unpack(const char* tree, backend_t const* backend, const char* archive, const char* output) {
+	uint64_t* const samples = calloc(repeat, sizeof *samples);
+	uint64_t bytes = 0;
+	uint64_t syscalls = 0;
+
+	int rv = -1;
+
+	for (uint64_t i = 0; i < repeat; i++) {
+		iar_file_t iar = { 0 };
+
+		if (iar_open_read(&iar, archive) < 0) {
+			goto error;
+		}
+
+		if (iar_set_io(&iar, backend->io) < 0) {
+			iar_close(&iar);
+			goto error;
+		}
+
+		uint64_t entries;
+		iar_node_totals(&iar, &iar.root_node, &bytes, &entries);
+
+		uint64_t const start = now_ns();
+		int const unpack_rv = iar_unpack(&iar, output);
+		samples[i] = now_ns() - start;
+
+		syscalls += iar.stats.syscalls;
+		iar_close(&iar);
+		remove_tree(output);
+
+		if (unpack_rv < 0) {
+			goto error;
+		}
+	}
+
+	report(tree, backend->name, "unpack", samples, repeat, bytes * repeat, syscalls);
+	rv = 0;
+
+error:
+
+	free(samples);
+	return rv;
+}
+
+static int check_content(const char* src, file_t* file, const void* buf) { // compare what was read out of the archive against the file it was packed from
+	size_t const path_bytes = strlen(src) + strlen(file->path) + 2;
+	char* const path = malloc(path_bytes);
+	snprintf(path, path_bytes, "%s/%s", src, file->path);
+
+	int const fd = open(path, O_RDONLY);
+	int rv = -1;
+
+	if (fd < 0) {
+		fprintf(stderr, "ERROR Failed to open '%s' (%s)\n", path, strerror(errno));
+		goto error;
+	}
+
+	uint8_t chunk[64 << 10];
+
+	for (uint64_t offset = 0; offset < file->node.data_bytes;) {
+		ssize_t const bytes = pread(fd, chunk, MIN(file->node.data_bytes - offset, sizeof chunk), offset);
+
+		if (bytes <= 0 || memcmp(chunk, (const uint8_t*) buf + offset, bytes)) {
+			fprintf(stderr, "ERROR Content of '%s' differs from what was read out of the archive\n", file->path);
+			goto error;
+		}
+
+		offset += bytes;
+	}
+
+	rv = 0;
+
+error:
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	free(path);
+	return rv;
+}
+
+#define ACCESS_FIND_NODE 0 // 'iar_find_node' in the file's directory
+#define ACCESS_FIND_PATH 1 // 'iar_find_node_path' from the root
+#define ACCESS_READ 2 // 'iar_read_node_content'
+#define ACCESS_MAP 3 // 'iar_map_node_content' & touch every page
+#define ACCESS_PREFETCH 4 // 'iar_prefetch' on its own
+#define ACCESS_PIN 5 // 'iar_map_node_content', 'iar_pin_node_content', touch every page & 'iar_unpin_node_content' (only for files up to 'PIN_MAX_BYTES')
+#define ACCESS_COUNT 6
+
+#define PIN_MAX_BYTES (16 << 10) // stay well within the smallest default 'RLIMIT_MEMLOCK' (64 KiB)
+
+static const char* const access_names[ACCESS_COUNT] = {
+	[ACCESS_FIND_NODE] = "find_node",
+	[ACCESS_FIND_PATH] = "find_path",
+	[ACCESS_READ] = "read",
+	[ACCESS_MAP] = "map",
+	[ACCESS_PREFETCH] = "prefetch",
+	[ACCESS_PIN] = "pin",
+};
+
+static int bench_access(const char* tree, backend_t const* backend, const char* src, const char* archive, file_list_t* list) {
+	iar_file_t iar = { 0 };
+
+	if (iar_open_read(&iar, archive) < 0) {
+		return -1;
+	}
+
+	int rv = -1;
+
+	size_t const stride = MAX(list->count / max_samples, 1);
+	size_t const count = (list->count + stride - 1) / stride;
+
+	uint64_t* const samples = calloc(count, sizeof *samples);
+
+	// everything is read into & mapped at the same place, big enough for the biggest file
+
+	uint64_t const page_bytes = sysconf(_SC_PAGESIZE);
+	uint64_t max_bytes = page_bytes;
+
+	for (size_t i = 0; i < list->count; i++) {
+		max_bytes = MAX(max_bytes, list->files[i].node.data_bytes);
+	}
+
+	max_bytes = (max_bytes + page_bytes - 1) & ~(page_bytes - 1);
+
+	char* const buf = malloc(max_bytes);
+	uint8_t* const region = mmap(NULL, max_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (region == MAP_FAILED) {
+		fprintf(stderr, "ERROR Failed to reserve memory to map files at (%s)\n", strerror(errno));
+		goto error_region;
+	}
+
+	if (iar_set_io(&iar, backend->io) < 0) {
+		goto error;
+	}
+
+	for (int access = 0; access < ACCESS_COUNT; access++) {
+		uint64_t bytes = 0;
+		uint64_t const syscalls = iar.stats.syscalls;
+
+		size_t sample_count = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			file_t* const file = &list->files[i * stride];
+			iar_node_t node;
+
+			if (access == ACCESS_PIN && file->node.data_bytes > PIN_MAX_BYTES) {
+				continue;
+			}
+
+			uint64_t const start = now_ns();
+
+			if (access == ACCESS_FIND_NODE && iar_find_node(&iar, &node, strrchr(file->path, '/') ? strrchr(file->path, '/') + 1 : file->path, &file->parent) == -1ull) {
+				fprintf(stderr, "ERROR Couldn't find '%s'\n", file->path);
+				goto error;
+			}
+
+			if (access == ACCESS_FIND_PATH && iar_find_node_path(&iar, &node, file->path) == -1ull) {
+				fprintf(stderr, "ERROR Couldn't find '%s'\n", file->path);
+				goto error;
+			}
+
+			if (access == ACCESS_READ && iar_read_node_content(&iar, &file->node, buf) < 0) {
+				goto error;
+			}
+
+			if ((access == ACCESS_MAP || access == ACCESS_PIN) && file->node.data_bytes) {
+				if (iar_map_node_content(&iar, &file->node, region) < 0) {
+					goto error;
+				}
+
+				if (access == ACCESS_PIN && iar_pin_node_content(&iar, &file->node, region) < 0) {
+					goto error;
+				}
+
+				volatile uint8_t sum = 0;
+
+				for (uint64_t offset = 0; offset < file->node.data_bytes; offset += page_bytes) {
+					sum += region[offset];
+				}
+
+				if (access == ACCESS_PIN && iar_unpin_node_content(&iar, &file->node, region) < 0) {
+					goto error;
+				}
+			}
+
+			if (access == ACCESS_PREFETCH && iar_prefetch(&iar, &file->node, 1) < 0) {
+				goto error;
+			}
+
+			samples[sample_count++] = now_ns() - start;
+
+			if (access == ACCESS_READ || access == ACCESS_MAP || access == ACCESS_PIN) {
+				bytes += file->node.data_bytes;
+			}
+
+			// make sure what's been read or mapped is actually the file's content (outside of the timed part)
+
+			if (access == ACCESS_READ && check_content(src, file, buf) < 0) {
+				goto error;
+			}
+
+			if (access == ACCESS_MAP && file->node.data_bytes && check_content(src, file, region) < 0) {
+				goto error;
+			}
+		}
+
+		report(tree, backend->name, access_names[access], samples, sample_count, bytes, iar.stats.syscalls - syscalls);
+	}
+
+	rv = 0;
+
+error:
+
+	munmap(region, max_bytes);
+
+error_region:
+
+	free(buf);
+	free(samples);
+	iar_close(&iar);
+
+	return rv;
+}
+
+// asynchronous access
+// files are found by path & then read, both through 'iar_async_submit', with up to 'ASYNC_BATCH' of them in flight at once
+// each sample is the time from submitting a file's lookup to its read being reaped
+
+#define ASYNC_THREADS 4
+#define ASYNC_BATCH 64
+
+typedef struct {
+	iar_async_t* async;
+	iar_request_t request;
+
+	file_t* file;
+	uint64_t start;
+	uint64_t* sample; // set once the read has been reaped, left at 0 if either request failed
+
+	size_t* remaining;
+} async_op_t;
+
+static void async_cb(iar_request_t* request) {
+	async_op_t* const op = request->user;
+
+	if (request->rv < 0 || request->node.data_offset != op->file->node.data_offset) {
+		fprintf(stderr, "ERROR Asynchronous %s of '%s' failed\n", request->type == IAR_REQUEST_FIND ? "lookup" : "read", op->file->path);
+		(*op->remaining)--;
+
+		return;
+	}
+
+	// the lookup leaves the node it found in the request, which is all a read needs
+
+	if (request->type == IAR_REQUEST_FIND) {
+		request->type = IAR_REQUEST_READ;
+		iar_async_submit(op->async, request);
+
+		return;
+	}
+
+	*op->sample = now_ns() - op->start;
+	(*op->remaining)--;
+}
+
+static int bench_async(const char* tree, backend_t const* backend, const char* src, const char* archive, file_list_t* list) {
+	iar_file_t iar = { 0 };
+
+	if (iar_open_read(&iar, archive) < 0) {
+		return -1;
+	}
+
+	iar_async_t async;
+
+	if (iar_set_io(&iar, backend->io) < 0 || iar_async_open(&iar, &async, ASYNC_THREADS) < 0) {
+		iar_close(&iar);
+		return -1;
+	}
+
+	int rv = -1;
+
+	size_t const stride = MAX(list->count / max_samples, 1);
+	size_t const count = (list->count + stride - 1) / stride;
+
+	uint64_t* const samples = calloc(count, sizeof *samples);
+	async_op_t* const ops = calloc(ASYNC_BATCH, sizeof *ops);
+
+	uint64_t bytes = 0;
+	uint64_t const syscalls = iar.stats.syscalls;
+
+	for (size_t batch = 0; batch < count; batch += ASYNC_BATCH) {
+		size_t const batch_count = MIN(count - batch, ASYNC_BATCH);
+		size_t remaining = batch_count;
+
+		for (size_t i = 0; i < batch_count; i++) {
+			async_op_t* const op = &ops[i];
+			file_t* const file = &list->files[(batch + i) * stride];
+
+			op->async = &async;
+			op->file = file;
+			op->sample = &samples[batch + i];
+			op->remaining = &remaining;
+
+			memset(&op->request, 0, sizeof op->request);
+
+			op->request.type = IAR_REQUEST_FIND;
+			op->request.path = file->path;
+			op->request.buf = malloc(MAX(file->node.data_bytes, 1));
+			op->request.callback = async_cb;
+			op->request.user = op;
+
+			op->start = now_ns();
+			iar_async_submit(&async, &op->request);
+		}
+
+		while (remaining) {
+			iar_async_reap(&async, 1);
+		}
+
+		int failed = 0;
+
+		for (size_t i = 0; i < batch_count; i++) {
+			async_op_t* const op = &ops[i];
+
+			failed |= !*op->sample || check_content(src, op->file, op->request.buf) < 0;
+			bytes += op->file->node.data_bytes;
+
+			free(op->request.buf);
+		}
+
+		if (failed) {
+			goto error;
+		}
+	}
+
+	report(tree, backend->name, "async", samples, count, bytes, iar.stats.syscalls - syscalls);
+	rv = 0;
+
+error:
+
+	iar_async_close(&async);
+	iar_close(&iar);
+
+	free(ops);
+	free(samples);
+
+	return rv;
+}
+
+// archives in memory
+// the tree is packed with 'iar_open_mem_write' & the result read back with 'iar_open_mem_read', finding & reading each file like 'bench_access' does
+
+static int bench_mem(const char* tree, const char* src, file_list_t* list) {
+	uint64_t* samples = calloc(repeat, sizeof *samples);
+	uint64_t bytes = 0;
+	uint64_t syscalls = 0;
+
+	void* mem = NULL;
+	uint64_t mem_bytes = 0;
+
+	iar_file_t iar = { 0 };
+	int rv = -1;
+
+	for (uint64_t i = 0; i < repeat; i++) {
+		uint64_t const start = now_ns();
+
+		if (iar_open_mem_write(&iar) < 0) {
+			goto error;
+		}
+
+		if (iar_pack(&iar, src, NULL) < 0 || iar_write_header(&iar) < 0) {
+			iar_close(&iar);
+			goto error;
+		}
+
+		// keep the archive around, as 'iar_close' would free it otherwise
+
+		free(mem);
+
+		mem = iar.mem;
+		mem_bytes = iar.mem_bytes;
+
+		iar.mem = NULL;
+		iar_close(&iar);
+
+		samples[i] = now_ns() - start;
+		syscalls += iar.stats.syscalls;
+	}
+
+	if (iar_open_mem_read(&iar, mem, mem_bytes) < 0) {
+		goto error;
+	}
+
+	uint64_t entries;
+
+	if (iar_node_totals(&iar, &iar.root_node, &bytes, &entries) < 0) {
+		goto error_read;
+	}
+
+	report(tree, "mem", "pack", samples, repeat, bytes * repeat, syscalls);
+
+	if (!list->count && collect_files(&iar, &iar.root_node, "", list) < 0) {
+		goto error_read;
+	}
+
+	size_t const stride = MAX(list->count / max_samples, 1);
+	size_t const count = (list->count + stride - 1) / stride;
+
+	free(samples);
+	samples = calloc(count, sizeof *samples);
+
+	uint64_t max_bytes = 1;
+
+	for (size_t i = 0; i < list->count; i++) {
+		max_bytes = MAX(max_bytes, list->files[i].node.data_bytes);
+	}
+
+	char* const buf = malloc(max_bytes);
+	iar_node_t* const nodes = calloc(count, sizeof *nodes);
+
+	for (size_t i = 0; i < count; i++) {
+		file_t* const file = &list->files[i * stride];
+		uint64_t const start = now_ns();
+
+		if (iar_find_node_path(&iar, &nodes[i], file->path) == -1ull) {
+			fprintf(stderr, "ERROR Couldn't find '%s'\n", file->path);
+			goto error_nodes;
+		}
+
+		samples[i] = now_ns() - start;
+	}
+
+	report(tree, "mem", "find_path", samples, count, 0, iar.stats.syscalls);
+	syscalls = iar.stats.syscalls;
+	bytes = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		file_t* const file = &list->files[i * stride];
+		uint64_t const start = now_ns();
+
+		if (iar_read_node_content(&iar, &nodes[i], buf) < 0) {
+			goto error_nodes;
+		}
+
+		samples[i] = now_ns() - start;
+		bytes += nodes[i].data_bytes;
+
+		if (nodes[i].data_bytes != file->node.data_bytes || check_content(src, file, buf) < 0) {
+			goto error_nodes;
+		}
+	}
+
+	report(tree, "mem", "read", samples, count, bytes, iar.stats.syscalls - syscalls);
+	rv = 0;
+
+error_nodes:
+
+	free(nodes);
+	free(buf);
+
+error_read:
+
+	iar_close(&iar);
+
+error:
+
+	free(mem);
+	free(samples);
+
+	return rv;
+}
+
+static int bench_tree(tree_t const* tree, const char* work_dir, const char* only_io) {
+	size_t const path_bytes = strlen(work_dir) + strlen(tree->name) + 32;
+
+	char* const tree_dir = malloc(path_bytes);
+	char* const src = malloc(path_bytes);
+	char* const archive = malloc(path_bytes);
+	char* const output = malloc(path_bytes);
+
+	snprintf(tree_dir, path_bytes, "%s/%s", work_dir, tree->name);
+	snprintf(src, path_bytes, "%s/src", tree_dir);
+	snprintf(output, path_bytes, "%s/out", tree_dir);
+
+	file_list_t list = { 0 };
+	int rv = -1;
+
+	remove_tree(tree_dir);
+
+	if (mkdir(tree_dir, 0755) < 0 || mkdir(src, 0755) < 0) {
+		fprintf(stderr, "ERROR Failed to create '%s' (%s)\n", src, strerror(errno));
+		goto error;
+	}
+
+	int const src_fd = open(src, O_RDONLY | O_DIRECTORY);
+
+	if (src_fd < 0) {
+		fprintf(stderr, "ERROR Failed to open '%s' (%s)\n", src, strerror(errno));
+		goto error;
+	}
+
+	int const gen_rv = tree->gen(src_fd);
+	close(src_fd);
+
+	if (gen_rv < 0) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < BACKEND_COUNT; i++) {
+		backend_t const* const backend = &backends[i];
+
+		if (only_io && strcmp(only_io, backend->name)) {
+			continue;
+		}
+
+		// the archive is the same whatever the backend it's packed with, so the last one packed is what's read back
+
+		snprintf(archive, path_bytes, "%s/%s.iar", tree_dir, backend->name);
+
+		if (bench_pack(tree->name, backend, src, archive) < 0) {
+			fprintf(stderr, "Skipping the '%s' backend for '%s'\n", backend->name, tree->name);
+			remove(archive);
+
+			continue;
+		}
+
+		if (bench_unpack(tree->name, backend, archive, output) < 0) {
+			goto error;
+		}
+
+		if (!list.count) {
+			iar_file_t iar = { 0 };
+
+			if (iar_open_read(&iar, archive) < 0) {
+				goto error;
+			}
+
+			int const collect_rv = collect_files(&iar, &iar.root_node, "", &list);
+			iar_close(&iar);
+
+			if (collect_rv < 0) {
+				goto error;
+			}
+		}
+
+		if (bench_access(tree->name, backend, src, archive, &list) < 0 || bench_async(tree->name, backend, src, archive, &list) < 0) {
+			goto error;
+		}
+
+		remove(archive);
+	}
+
+	if ((!only_io || !strcmp(only_io, "mem")) && bench_mem(tree->name, src, &list) < 0) {
+		goto error;
+	}
+
+	rv = 0;
+
+error:
+
+	free_files(&list);
+	remove_tree(tree_dir);
+
+	free(tree_dir);
+	free(src);
+	free(archive);
+	free(output);
+
+	return rv;
+}
+
+int main(int argc, char** argv) {
+	char* work_dir = "bench";
+	char* only_tree = NULL;
+	char* only_io = NULL;
+	char* baseline_path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) || i + 1 >= argc) {
+			fprintf(stderr, "ERROR Unexpected argument '%s'\n", argv[i]);
+			return -1;
+		}
+
+		char* option = argv[i] + 2;
+
+		if (strcmp(option, "scale") == 0) {
+			scale = atoll(argv[++i]);
+		}
+
+		else if (strcmp(option, "repeat") == 0) {
+			repeat = atoll(argv[++i]);
+		}
+
+		else if (strcmp(option, "samples") == 0) {
+			max_samples = atoll(argv[++i]);
+		}
+
+		else if (strcmp(option, "tree") == 0) {
+			only_tree = argv[++i];
+		}
+
+		else if (strcmp(option, "io") == 0) {
+			only_io = argv[++i];
+		}
+
+		else if (strcmp(option, "dir") == 0) {
+			work_dir = argv[++i];
+		}
+
+		else if (strcmp(option, "baseline") == 0) {
+			baseline_path = argv[++i];
+		}
+
+		else {
+			fprintf(stderr, "ERROR Option '--%s' is unknown. Check README.md to see a list of available options\n", option);
+			return -1;
+		}
+	}
+
+	if (scale < 1 || repeat < 1 || max_samples < 1) {
+		fprintf(stderr, "ERROR '--scale', '--repeat' and '--samples' must be at least 1\n");
+		return -1;
+	}
+
+	if (baseline_path && load_baseline(baseline_path) < 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof pattern; i++) {
+		pattern[i] = i * 31 + i / 4096;
+	}
+
+	if (mkdir(work_dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "ERROR Failed to create '%s' (%s)\n", work_dir, strerror(errno));
+		return -1;
+	}
+
+	print_header();
+	int rv = 0;
+
+	for (size_t i = 0; i < TREE_COUNT; i++) {
+		if (only_tree && strcmp(only_tree, trees[i].name)) {
+			continue;
+		}
+
+		if (bench_tree(&trees[i], work_dir, only_io) < 0) {
+			rv = -1;
+			break;
+		}
+	}
+
+	free(baseline);
+	return rv;
+}
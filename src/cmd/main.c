@@ -2,31 +2,285 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if !defined(WITHOUT_JSON)
+	#include "json.h"
+#endif
 
 typedef enum {
 	MODE_UNKNOWN,
 	MODE_PACK,
 	MODE_UNPACK,
+	MODE_PATCH,
+	MODE_LIST,
 
 #if !defined(WITHOUT_JSON)
 	MODE_PACK_JSON,
 #endif
 } iar_mode_t;
 
+static iar_mode_t mode = MODE_UNKNOWN;
+static char* mode_option = NULL; // option which set the mode, for error messages
+
+static int set_mode(iar_mode_t new_mode, char* option) {
+	if (mode != MODE_UNKNOWN && mode != new_mode) {
+		fprintf(stderr, "ERROR '--%s' has already been passed\n", mode_option);
+		return -1;
+	}
+
+	mode = new_mode;
+	mode_option = option;
+
+	return 0;
+}
+
+static void* read_whole_file(const char* path, uint64_t* bytes_ref) {
+	FILE* fp = fopen(path, "rb");
+
+	if (!fp) {
+		fprintf(stderr, "ERROR Failed to open '%s'\n", path);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size_t bytes = ftell(fp);
+
+	void* data = malloc(bytes + 1); // +1 so we never malloc 0 bytes
+
+	rewind(fp);
+
+	if (fread(data, 1, bytes, fp) != bytes) {
+		fprintf(stderr, "ERROR Failed to read '%s'\n", path);
+
+		free(data);
+		fclose(fp);
+
+		return NULL;
+	}
+
+	fclose(fp);
+
+	*bytes_ref = bytes;
+	return data;
+}
+
+static int list_walk(iar_file_t* iar, iar_node_t* node, const char* path) {
+	iar_dir_t dir;
+
+	if (iar_opendir(iar, &dir, node) < 0) {
+		return -1;
+	}
+
+	iar_dirent_t* dirent;
+
+	while ((dirent = iar_readdir(&dir))) {
+		char* path_buf = malloc(strlen(path) + strlen(dirent->name) + 2 /* strlen("/") + 1 */);
+		sprintf(path_buf, *path ? "%s/%s" : "%s%s", path, dirent->name);
+
+		if (!dirent->node.is_dir) {
+			printf("%lu\t%lu\t%s\n", dirent->node.data_offset, dirent->node.data_bytes, path_buf);
+			free(path_buf);
+
+			continue;
+		}
+
+		// directory tables give us the total size of directories for free, but don't bother walking the whole subtree if we don't have them
+
+		uint64_t bytes, entries;
+
+		if (iar->header.version >= 2 && iar_node_totals(iar, &dirent->node, &bytes, &entries) == 0) {
+			printf("%lu\t%lu\t%s/\n", dirent->offset, bytes, path_buf);
+		}
+
+		else {
+			printf("%lu\t-\t%s/\n", dirent->offset, path_buf);
+		}
+
+		int rv = list_walk(iar, &dirent->node, path_buf);
+		free(path_buf);
+
+		if (rv < 0) {
+			iar_closedir(&dir);
+			return -1;
+		}
+	}
+
+	int rv = -(dir.index < dir.node_count); // did we stop early because of an error?
+
+	iar_closedir(&dir);
+	return rv;
+}
+
+static void print_progress(iar_file_t* iar, uint64_t bytes_done, uint64_t bytes_total) {
+	(void) iar;
+
+	static uint64_t prev_percentage = -1;
+	uint64_t const percentage = bytes_total ? bytes_done * 100 / bytes_total : 100;
+
+	if (percentage == prev_percentage) {
+		return;
+	}
+
+	prev_percentage = percentage;
+	fprintf(stderr, "\rUnpacking... %lu%%%s", percentage, bytes_done == bytes_total ? "\n" : "");
+}
+
+#if !defined(WITHOUT_JSON)
+
+// a member of a JSON object whose value is a number, along with everything it points to
+
+typedef struct {
+	char buf[32];
+
+	struct json_number_s number;
+	struct json_string_s name;
+	struct json_value_s value;
+	struct json_object_element_s member;
+} stats_member_t;
+
+static void stats_member(stats_member_t* member, const char* name, uint64_t n, struct json_object_element_s* next) {
+	member->number.number = member->buf;
+	member->number.number_size = snprintf(member->buf, sizeof member->buf, "%lu", n);
+
+	member->name.string = name;
+	member->name.string_size = strlen(name);
+
+	member->value.payload = &member->number;
+	member->value.type = json_type_number;
+
+	member->member.name = &member->name;
+	member->member.value = &member->value;
+	member->member.next = next;
+}
+
+static void print_stats_json(iar_stats_t* stats) {
+	// phase times go in an object of their own
+
+	stats_member_t phases[IAR_PHASE_COUNT];
+
+	for (int i = IAR_PHASE_COUNT - 1; i >= 0; i--) {
+		stats_member(&phases[i], iar_phase_name(i), stats->phase_ns[i], i + 1 < IAR_PHASE_COUNT ? &phases[i + 1].member : NULL);
+	}
+
+	struct json_object_s phases_obj = { &phases[0].member, IAR_PHASE_COUNT };
+	struct json_value_s phases_value = { &phases_obj, json_type_object };
+	struct json_string_s phases_name = { "phase_ns", strlen("phase_ns") };
+	struct json_object_element_s phases_member = { &phases_name, &phases_value, NULL };
+
+	// counters
+
+	stats_member_t counters[5];
+
+	stats_member(&counters[4], "cache_hits", stats->cache_hits, &phases_member);
+	stats_member(&counters[3], "lookups", stats->lookups, &counters[4].member);
+	stats_member(&counters[2], "bytes_written", stats->bytes_written, &counters[3].member);
+	stats_member(&counters[1], "bytes_read", stats->bytes_read, &counters[2].member);
+	stats_member(&counters[0], "syscalls", stats->syscalls, &counters[1].member);
+
+	struct json_object_s obj = { &counters[0].member, 6 };
+	struct json_value_s value = { &obj, json_type_object };
+
+	char* const json = json_write_pretty(&value, "\t", "\n", NULL);
+
+	if (!json) {
+		fprintf(stderr, "ERROR Failed to write stats as JSON\n");
+		return;
+	}
+
+	fprintf(stderr, "%s\n", json);
+	free(json);
+}
+
+#endif
+
+static void print_stats(iar_stats_t* stats, int json) {
+#if !defined(WITHOUT_JSON)
+	if (json) {
+		print_stats_json(stats);
+		return;
+	}
+#else
+	(void) json;
+#endif
+
+	fprintf(stderr, "syscalls\t%lu\n", stats->syscalls);
+	fprintf(stderr, "bytes_read\t%lu\n", stats->bytes_read);
+	fprintf(stderr, "bytes_written\t%lu\n", stats->bytes_written);
+	fprintf(stderr, "lookups\t%lu\n", stats->lookups);
+	fprintf(stderr, "cache_hits\t%lu\n", stats->cache_hits);
+
+	for (int i = 0; i < IAR_PHASE_COUNT; i++) {
+		fprintf(stderr, "%s_ns\t%lu\n", iar_phase_name(i), stats->phase_ns[i]);
+	}
+}
+
+static void set_options(iar_file_t* iar, iar_file_t const* options) { // opening resets these, so they're only copied over once the file's been opened
+	iar->base = options->base;
+	iar->trace = options->trace;
+	iar->layout = options->layout;
+	iar->scan_threads = options->scan_threads;
+	iar->progress = options->progress;
+	iar->mmap_write = options->mmap_write;
+}
+
+static int open_read(iar_file_t* iar, const char* path, uint64_t base_offset, int* fd_ref) {
+	if (!base_offset) {
+		return iar_open_read(iar, path);
+	}
+
+	// the archive is embedded somewhere in a larger file
+
+	int const fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "ERROR Failed to open '%s' for reading\n", path);
+		return -1;
+	}
+
+	if (iar_open_read_fd(iar, fd, base_offset) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	*fd_ref = fd;
+	return 0;
+}
+
 int main(int argc, char** argv) {
 	if (argc == 1) {
 		fprintf(stderr, "ERROR No arguments provided\n");
 		return -1;
 	}
 
-	iar_mode_t mode = MODE_UNKNOWN;
 	uint64_t page_bytes = IAR_DEFAULT_PAGE_BYTES;
+	uint64_t scan_threads = 0;
+	int progress = 0;
+	int mmap_write = 0;
 
 	char* pack_output = "output.iar";
 	char* unpack_output = "output";
 
 	char* unpack_file = NULL;
+	uint64_t base_offset = 0;
+	int base_offset_fd = -1;
+	const iar_io_t* io = NULL;
+
+	const char** extract_entries = malloc(argc * sizeof *extract_entries); // can't be more entries than arguments
+	size_t extract_entry_count = 0;
 	char* pack_dir = NULL;
+	char* pack_base = NULL;
+	char* pack_layout = NULL;
+	char* trace_path = NULL;
+	int stats = 0; // 1 for text, 2 for JSON
+
+	char* list_file = NULL;
+
+	char* patch_file = NULL;
+	char* patch_entry = NULL;
+	char* patch_input = NULL;
 
 	#if !defined(WITHOUT_JSON)
 		char* pack_json = NULL;
@@ -54,57 +308,130 @@ int main(int argc, char** argv) {
 			return 0;
 		}
 
+		else if (strcmp(option, "threads") == 0) {
+			scan_threads = atoll(argv[++i]);
+		}
+
+		else if (strcmp(option, "progress") == 0) {
+			progress = 1;
+		}
+
+		else if (strcmp(option, "mmap") == 0) {
+			mmap_write = 1;
+		}
+
+		else if (strcmp(option, "offset") == 0) {
+			base_offset = atoll(argv[++i]);
+		}
+
+		else if (strcmp(option, "io") == 0) {
+			char* const io_name = argv[++i];
+
+			if (strcmp(io_name, "pread") == 0) {
+				io = &iar_io_pread;
+			}
+
+			else if (strcmp(io_name, "mmap") == 0) {
+				io = &iar_io_mmap;
+			}
+
+#if defined(__linux__)
+			else if (strcmp(io_name, "uring") == 0) {
+				io = &iar_io_uring;
+			}
+#endif
+
+			else {
+				fprintf(stderr, "ERROR Unknown I/O backend '%s'\n", io_name);
+				return -1;
+			}
+		}
+
 		else if (strcmp(option, "output") == 0) {
 			pack_output = unpack_output = argv[++i];
 		}
 
-		else if (strcmp(option, "pack") == 0) {
-			if (mode == MODE_UNPACK) {
-				fprintf(stderr, "ERROR '--unpack' has already been passed\n");
+		else if (strcmp(option, "base") == 0) {
+			pack_base = argv[++i];
+		}
+
+		else if (strcmp(option, "layout") == 0) {
+			pack_layout = argv[++i];
+		}
+
+		else if (strcmp(option, "trace") == 0) {
+			trace_path = argv[++i];
+		}
+
+		else if (strcmp(option, "stats") == 0) {
+			char* const format = argv[++i];
+
+			if (strcmp(format, "text") == 0) {
+				stats = 1;
+			}
+
+		#if !defined(WITHOUT_JSON)
+			else if (strcmp(format, "json") == 0) {
+				stats = 2;
+			}
+		#endif
+
+			else {
+				fprintf(stderr, "ERROR Unknown stats format '%s'\n", format);
 				return -1;
 			}
+		}
 
-			#if !defined(WITHOUT_JSON)
-				if (mode == MODE_PACK_JSON) {
-					fprintf(stderr, "ERROR '--json' has already been passed\n");
-					return -1;
-				}
-			#endif
+		else if (strcmp(option, "pack") == 0) {
+			if (set_mode(MODE_PACK, option) < 0) {
+				return -1;
+			}
 
-			mode = MODE_PACK;
 			pack_dir = argv[++i];
 		}
 
 		else if (strcmp(option, "unpack") == 0) {
-			if (mode == MODE_PACK) {
-				fprintf(stderr, "ERROR '--pack' has already been passed\n");
+			if (set_mode(MODE_UNPACK, option) < 0) {
 				return -1;
 			}
 
-			#if !defined(WITHOUT_JSON)
-				if (mode == MODE_PACK_JSON) {
-					fprintf(stderr, "ERROR '--json' has already been passed\n");
-					return -1;
-				}
-			#endif
-
-			mode = MODE_UNPACK;
 			unpack_file = argv[++i];
 		}
 
+		else if (strcmp(option, "list") == 0) {
+			if (set_mode(MODE_LIST, option) < 0) {
+				return -1;
+			}
+
+			list_file = argv[++i];
+		}
+
+		else if (strcmp(option, "extract") == 0) {
+			extract_entries[extract_entry_count++] = argv[++i];
+		}
+
+		else if (strcmp(option, "patch") == 0) {
+			if (set_mode(MODE_PATCH, option) < 0) {
+				return -1;
+			}
+
+			patch_file = argv[++i];
+		}
+
+		else if (strcmp(option, "entry") == 0) {
+			patch_entry = argv[++i];
+		}
+
+		else if (strcmp(option, "input") == 0) {
+			patch_input = argv[++i];
+		}
+
 		#if !defined(WITHOUT_JSON)
 			else if (strcmp(option, "json") == 0) {
-				if (mode == MODE_PACK) {
-					fprintf(stderr, "ERROR '--pack' has already been passed\n");
+				if (set_mode(MODE_PACK_JSON, option) < 0) {
 					return -1;
 				}
 
-				if (mode == MODE_UNPACK) {
-					fprintf(stderr, "ERROR '--unpack' has already been passed\n");
-					return -1;
-				}
-
-				mode = MODE_PACK_JSON;
 				pack_json = argv[++i];
 			}
 		#endif
@@ -115,32 +442,156 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	iar_file_t iar = {
-		.header = {
-			.page_bytes = page_bytes,
-		},
-	};
+	iar_file_t iar = { 0 };
+	iar_file_t options = { 0 };
+
+	options.scan_threads = scan_threads;
+	options.mmap_write = mmap_write;
 
+	if (progress) {
+		options.progress = print_progress;
+	}
+
+	iar_file_t base = { 0 };
 	int rv = -1;
 
+	if (pack_base && mode != MODE_PACK) {
+		fprintf(stderr, "ERROR '--base' can only be used with '--pack'\n");
+		goto error_open;
+	}
+
+	if (extract_entry_count && mode != MODE_UNPACK) {
+		fprintf(stderr, "ERROR '--extract' can only be used with '--unpack'\n");
+		goto error_open;
+	}
+
+	if (mmap_write && mode != MODE_PACK) {
+		fprintf(stderr, "ERROR '--mmap' can only be used with '--pack'\n");
+		goto error_open;
+	}
+
+	if (mmap_write && scan_threads < 2) {
+		fprintf(stderr, "ERROR '--mmap' needs '--threads' to be more than one, as the size of the archive has to be known beforehand\n");
+		goto error_open;
+	}
+
+	if (mmap_write && pack_layout) {
+		fprintf(stderr, "ERROR '--mmap' can't be used with '--layout'\n");
+		goto error_open;
+	}
+
+	if (pack_layout && mode != MODE_PACK) {
+		fprintf(stderr, "ERROR '--layout' can only be used with '--pack'\n");
+		goto error_open;
+	}
+
+	if (pack_layout && !(options.layout = fopen(pack_layout, "r"))) {
+		fprintf(stderr, "ERROR Failed to open layout trace '%s'\n", pack_layout);
+		goto error_open;
+	}
+
+	if (trace_path && !(options.trace = fopen(trace_path, "w"))) {
+		fprintf(stderr, "ERROR Failed to open '%s' for tracing\n", trace_path);
+		goto error_open;
+	}
+
 	if (mode == MODE_PACK) {
+		if (pack_base) {
+			// opening the output for writing would truncate the base archive if they're the same file
+
+			struct stat base_sb, output_sb;
+
+			if (stat(pack_base, &base_sb) == 0 && stat(pack_output, &output_sb) == 0 && base_sb.st_dev == output_sb.st_dev && base_sb.st_ino == output_sb.st_ino) {
+				fprintf(stderr, "ERROR Base archive '%s' can't also be the output\n", pack_base);
+				goto error_open;
+			}
+
+			if (iar_open_read(&base, pack_base) < 0) {
+				goto error_open;
+			}
+
+			options.base = &base;
+		}
+
 		if (iar_open_write(&iar, pack_output) < 0) {
-			goto error_open;
+			goto error_base;
 		}
 
-		if (iar_pack(&iar, pack_dir, NULL) < 0) {
+		set_options(&iar, &options);
+
+		iar.header.page_bytes = page_bytes;
+
+		if (io && iar_set_io(&iar, io) < 0) {
 			goto error;
 		}
 
-		iar_write_header(&iar);
+		if (iar_pack(&iar, pack_dir, NULL) < 0 || iar_write_header(&iar) < 0) {
+			goto error;
+		}
 	}
 
 	else if (mode == MODE_UNPACK) {
-		if (iar_open_read(&iar, unpack_file) < 0) {
+		if (open_read(&iar, unpack_file, base_offset, &base_offset_fd) < 0) {
+			goto error_open;
+		}
+
+		set_options(&iar, &options);
+
+		if (io && iar_set_io(&iar, io) < 0) {
+			goto error;
+		}
+
+		if (extract_entry_count) {
+			if (iar_extract(&iar, unpack_output, extract_entries, extract_entry_count) < 0) {
+				goto error;
+			}
+		}
+
+		else if (iar_unpack(&iar, unpack_output) < 0) {
+			goto error;
+		}
+	}
+
+	else if (mode == MODE_LIST) {
+		if (open_read(&iar, list_file, base_offset, &base_offset_fd) < 0) {
+			goto error_open;
+		}
+
+		set_options(&iar, &options);
+
+		if (io && iar_set_io(&iar, io) < 0) {
+			goto error;
+		}
+
+		if (list_walk(&iar, &iar.root_node, "") < 0) {
+			goto error;
+		}
+	}
+
+	else if (mode == MODE_PATCH) {
+		if (!patch_entry || !patch_input) {
+			fprintf(stderr, "ERROR '--patch' needs both '--entry' and '--input' to be passed\n");
+			goto error_open;
+		}
+
+		uint64_t bytes;
+		void* data = read_whole_file(patch_input, &bytes);
+
+		if (!data) {
+			goto error_open;
+		}
+
+		if (iar_open_patch(&iar, patch_file) < 0) {
+			free(data);
 			goto error_open;
 		}
 
-		if (iar_unpack(&iar, unpack_output) < 0) {
+		set_options(&iar, &options);
+
+		int patch_rv = iar_patch_path_content(&iar, patch_entry, data, bytes);
+		free(data);
+
+		if (patch_rv < 0) {
 			goto error;
 		}
 	}
@@ -151,11 +602,12 @@ int main(int argc, char** argv) {
 				goto error_open;
 			}
 
-			if (iar_pack_json(&iar, pack_json, NULL) < 0) {
+			set_options(&iar, &options);
+			iar.header.page_bytes = page_bytes;
+
+			if (iar_pack_json(&iar, pack_json, NULL) < 0 || iar_write_header(&iar) < 0) {
 				goto error;
 			}
-
-			iar_write_header(&iar);
 		}
 	#endif
 
@@ -165,7 +617,30 @@ error:
 
 	iar_close(&iar);
 
+error_base:
+
+	if (options.base) {
+		iar_close(options.base);
+	}
+
+	if (stats) {
+		print_stats(&iar.stats, stats == 2);
+	}
+
 error_open:
 
+	if (options.layout) {
+		fclose(options.layout);
+	}
+
+	if (options.trace) {
+		fclose(options.trace);
+	}
+
+	if (base_offset_fd >= 0) {
+		close(base_offset_fd);
+	}
+
+	free(extract_entries);
 	return rv;
 }
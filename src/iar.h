@@ -3,13 +3,14 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 // iar macros
 
 #define IAR_MAGIC 0x1A4C1A4C1A4C1A4C
 
 #if !defined(IAR_VERSION)
-	#define IAR_VERSION 1lu // *latest* supported version
+	#define IAR_VERSION 3lu // *latest* supported version
 #endif
 
 #if !defined(IAR_DEFAULT_PAGE_BYTES)
@@ -20,6 +21,26 @@
 	#define IAR_MAX_READ_BLOCK_SIZE 0x10000 // 64 KiB
 #endif
 
+#if !defined(IAR_DIR_TABLE_MAX_MEMORY)
+	#define IAR_DIR_TABLE_MAX_MEMORY 0x4000000 // 64 MiB
+#endif
+
+#if !defined(IAR_MAX_OPEN_DIRS)
+	#define IAR_MAX_OPEN_DIRS 64
+#endif
+
+#if !defined(IAR_WRITE_COMBINE_BYTES)
+	#define IAR_WRITE_COMBINE_BYTES 0x100000 // 1 MiB
+#endif
+
+#if !defined(IAR_COPY_RANGE_MIN_BYTES)
+	#define IAR_COPY_RANGE_MIN_BYTES 0x10000 // 64 KiB
+#endif
+
+#if !defined(IAR_MMAP_FLUSH_BYTES)
+	#define IAR_MMAP_FLUSH_BYTES 0x4000000 // 64 MiB
+#endif
+
 // iar data structures
 
 typedef struct {
@@ -46,41 +67,290 @@ typedef struct {
 	};
 } iar_node_t;
 
-// functions for opening / closing iar files
+// from version 2 onwards, the offset table of directory nodes is directly followed by the rest of their directory table
+// this starts with the totals for the whole subtree (two 'uint64_t''s: total size of all file data & total number of nodes, not including the directory itself)
+// then come arrays of 'uint64_t', which each have an element per child node (in the same order as the offset table):
+// - is_dir: bitmap ((node_count + 63) / 64 words, where bit 'i % 64' of word 'i / 64' is the child's 'is_dir')
+// - sizes: copy of the child's 'node_count' or 'data_bytes'
+// - offsets: copy of the child's 'node_offsets_offset' or 'data_offset'
+// - name_hashes: 64-bit FNV-1a hash of the child's name (not including the null-terminator)
+// - mtimes (version 3 onwards): modification time of the child when it was packed, in nanoseconds since the epoch (0 for directories, or if unknown)
+// - name_offsets: offset of the child's name relative to the start of the names (this one has an extra element at the end, which is the total size of the names)
+// the names (null-terminated) of all child nodes are then packed one after the other
+// this way, a whole directory can be read without having to read each of its child nodes separately
+
+// I/O backends
+// all I/O on an archive goes through one of these, so the fastest one can be picked for each situation (see 'iar_set_io')
+// 'read' & 'write' must read/write everything they're asked to unless they hit EOF (reads only) or an error, and return how many bytes they did or -1
+// 'setup', 'teardown', 'peek' & 'batch' are optional ('peek' returns a pointer straight to archive data if it's in memory, NULL otherwise)
+// 'batch' runs a number of independent operations (on the archive or on other files) all at once, setting each one's 'rv' like 'read' & 'write' would; it only fails if they couldn't be run at all
+
+#if !defined(IAR_IO_BATCH_OPS)
+	#define IAR_IO_BATCH_OPS 64 // most operations in flight at once with backends which batch them
+#endif
+
+struct iar_file_s;
+
+typedef struct {
+	int fd; // -1 for the archive itself (offsets are then relative to it), otherwise any other file
+	int write;
+
+	void* buf;
+	uint64_t bytes;
+	uint64_t offset;
+
+	ssize_t rv;
+} iar_io_op_t;
+
+typedef struct {
+	const char* name;
+
+	int (*setup)(struct iar_file_s* self);
+	void (*teardown)(struct iar_file_s* self);
+
+	ssize_t (*read)(struct iar_file_s* self, void* buf, uint64_t bytes, uint64_t offset);
+	ssize_t (*write)(struct iar_file_s* self, const void* buf, uint64_t bytes, uint64_t offset);
+	int (*size)(struct iar_file_s* self, uint64_t* bytes);
+	int (*truncate)(struct iar_file_s* self, uint64_t bytes);
+	const void* (*peek)(struct iar_file_s* self, uint64_t offset, uint64_t bytes);
+	int (*batch)(struct iar_file_s* self, iar_io_op_t* ops, size_t count);
+} iar_io_t;
+
+extern const iar_io_t iar_io_pread; // default for files
+extern const iar_io_t iar_io_mmap; // whole file mapped for reading
+extern const iar_io_t iar_io_mem; // default (& only option) for archives in memory
+
+#if defined(__linux__)
+	extern const iar_io_t iar_io_uring; // batches independent operations (e.g. reading all the nodes in a directory) & pipelines file data
+#endif
+
+// performance counters
+// these are only ever added to while operating on an archive, so zero them to start counting anew
+
+#define IAR_PHASE_LOOKUP 0 // finding nodes by name or path
+#define IAR_PHASE_SCAN 1 // scanning the tree beforehand when packing (see 'scan_threads')
+#define IAR_PHASE_PACK 2
+#define IAR_PHASE_UNPACK_WALK 3 // walking the node tree & creating directories
+#define IAR_PHASE_UNPACK_DATA 4 // writing out files
+#define IAR_PHASE_COUNT 5
 
 typedef struct {
+	uint64_t syscalls; // reads & writes issued, both of the archive & of the files being packed/unpacked
+	uint64_t bytes_read; // of the archive
+	uint64_t bytes_written; // of the archive
+	uint64_t lookups; // nodes looked up by name (one for each component of a path)
+	uint64_t cache_hits; // reads & writes served from memory instead of costing a syscall (mappings, names read along with their nodes, the write combining buffer)
+
+	uint64_t phase_ns[IAR_PHASE_COUNT]; // time spent in each phase, in nanoseconds
+} iar_stats_t;
+
+const char* iar_phase_name(int phase);
+
+// functions for opening / closing iar files
+
+typedef struct iar_file_s {
 	char* absolute_path;
 
 	FILE* fp;
-	int fd;
+	int fd; // -1 if in memory
+	uint64_t base_offset; // offset of the archive within its file
+
+	// archives in memory (see 'iar_open_mem_read' & 'iar_open_mem_write')
+	// when writing, the buffer grows as needed & 'mem_bytes' is the size of the archive so far
+	// it is freed by 'iar_close', so set 'mem' to NULL beforehand to keep it
+
+	void* mem;
+	uint64_t mem_bytes;
+	uint64_t mem_capacity; // 0 if the memory isn't ours (i.e. when reading)
+
+	const iar_io_t* io;
+
+	void* io_map; // for 'iar_io_mmap'
+	uint64_t io_map_bytes;
+
+	struct iar_ring_s* io_ring; // for 'iar_io_uring'
+
+	uint64_t dev; // device & inode number of the file (only when writing)
+	uint64_t ino;
 
 	iar_header_t header;
 	iar_node_t root_node;
 
 	uint64_t current_offset;
+
+	// the options below are reset by the 'iar_open_*' functions, so set them once the file has been opened
+
+	// previous archive (opened for reading) to reuse unchanged file data from when packing
+	// files are considered unchanged if they have the same path, size & modification time as recorded in the base (which must be version 3 or later)
+
+	struct iar_file_s* base;
+
+	// if set when reading, every file found by path, read or mapped is logged to this, in order (see 'libiar.c' for the format)
+	// if set when packing, files in such a trace are packed before everything else & in the order they were first accessed, so that they can be read sequentially
+
+	FILE* trace;
+	FILE* layout;
+
+	// number of threads to scan directories with when packing (0 or 1 means directories are scanned one at a time as they're packed)
+	// the output is the same regardless
+
+	uint64_t scan_threads;
+
+	// optionally called every time some data has been unpacked
+
+	void (*progress)(struct iar_file_s* self, uint64_t bytes_done, uint64_t bytes_total);
+
+	// counters of what's been done to the archive since it was opened (see 'iar_stats_t')
+
+	iar_stats_t stats;
+
+	// scratch memory for the operation in progress (paths, names, &c), all freed at once when it's done
+	// all data is copied through the same buffer of 'IAR_MAX_READ_BLOCK_SIZE' bytes, which is kept around until the file is closed
+
+	struct iar_arena_s* arena;
+	void* io_buf;
+	void* io_pipeline; // file data in flight with backends which batch operations
+
+	// small writes while packing are combined in a buffer of 'IAR_WRITE_COMBINE_BYTES' bytes & written out in one go
+
+	void* wc_buf;
+	uint64_t wc_offset;
+	uint64_t wc_bytes;
+	uint64_t wc_high;
+
+	// if set, the archive is written through a shared mapping of the whole thing instead, when packing
+	// this is only possible when its size is known beforehand, i.e. when the tree is scanned beforehand ('scan_threads > 1')
+
+	int mmap_write;
+
+	void* map;
+	uint64_t map_bytes;
+	uint64_t map_flushed;
 } iar_file_t;
 
 int iar_open_read(iar_file_t* self, const char* path);
 int iar_open_write(iar_file_t* self, const char* path);
+int iar_open_patch(iar_file_t* self, const char* path); // open for reading & modifying in place
+
+int iar_open_read_fd(iar_file_t* self, int fd, uint64_t base_offset); // for archives embedded in a larger file; 'fd' isn't closed by 'iar_close' & 'base_offset' must be page-aligned for 'iar_map_node_content' to work
+int iar_open_mem_read(iar_file_t* self, const void* ptr, size_t bytes); // 'ptr' must stay valid until 'iar_close'
+int iar_open_mem_write(iar_file_t* self);
+
+int iar_set_io(iar_file_t* self, const iar_io_t* io); // the default backend is set when opening, so this has to be called after that
 
 void iar_close(iar_file_t* self);
 
 // functions for reading iar files
 
 uint64_t iar_find_node(iar_file_t* self, iar_node_t* node, const char* name, iar_node_t* parent); // return the index of found file or -1 if nothing found
+uint64_t iar_find_node_path(iar_file_t* self, iar_node_t* node, const char* path); // path is relative to the root node (e.g. "dir/file"); return the offset of the found node or -1 if nothing found
 int iar_read_node_name(iar_file_t* self, iar_node_t* node, char* buffer);
+int iar_node_totals(iar_file_t* self, iar_node_t* node, uint64_t* bytes, uint64_t* entries); // total size of all file data & number of nodes in a subtree (constant time from version 2 onwards)
 
 int iar_read_node_content /* content not contents */ (iar_file_t* self, iar_node_t* node, char* buffer);
 int iar_map_node_content /* content not contents */ (iar_file_t* self, iar_node_t* node, void* address);
 
+int iar_prefetch(iar_file_t* self, iar_node_t* nodes, size_t count); // start reading the content of the given nodes into memory in the background, so that it's there by the time it's needed (directories are ignored)
+int iar_pin_node_content(iar_file_t* self, iar_node_t* node, void* address); // lock content mapped at 'address' (see 'iar_map_node_content') in memory, so that accessing it never faults (this is subject to 'RLIMIT_MEMLOCK')
+int iar_unpin_node_content(iar_file_t* self, iar_node_t* node, void* address);
+
+// functions for reading iar files asynchronously
+// requests are handed off to a pool of threads, so that the caller never has to block on the disk (e.g. from an event loop)
+// completed requests are collected until 'iar_async_reap' is called, which calls their callbacks on the calling thread
+// 'fd' becomes readable whenever there are completed requests to be reaped, so it can be polled along with everything else
+
+#define IAR_REQUEST_READ 0 // read the content of 'node' into 'buf' (which must be at least 'node.data_bytes' big)
+#define IAR_REQUEST_FIND 1 // find the node at 'path' (see 'iar_find_node_path') & put it in 'node' (& its offset in 'offset')
+
+typedef struct iar_request_s {
+	int type;
+
+	iar_node_t node;
+	void* buf;
+	const char* path;
+
+	void (*callback)(struct iar_request_s* request); // optional
+	void* user;
+
+	int rv; // 0 on success, -1 on failure
+	uint64_t offset;
+
+	struct iar_request_s* next; // for internal use
+} iar_request_t;
+
+typedef struct {
+	iar_file_t* iar;
+	int fd; // eventfd (or the read end of a pipe where there's no such thing)
+
+	struct iar_async_pool_s* pool;
+} iar_async_t;
+
+int iar_async_open(iar_file_t* self, iar_async_t* async, size_t threads);
+int iar_async_submit(iar_async_t* async, iar_request_t* request); // 'request' must stay valid until it's been reaped
+size_t iar_async_reap(iar_async_t* async, int wait); // call the callbacks of all completed requests & return how many there were; if 'wait' is set, block until there's at least one (unless there are none in flight)
+void iar_async_close(iar_async_t* async); // this waits for all requests in flight & reaps them
+
+// functions for listing iar files
+// these only ever read nodes & names, never file data
+
+#if !defined(IAR_DIRENT_PREFETCH_BYTES)
+	#define IAR_DIRENT_PREFETCH_BYTES 256 // how many bytes after each node to read in one go, in the hopes its name is in there
+#endif
+
+typedef struct {
+	uint64_t offset; // offset of the node itself
+	iar_node_t node;
+	char* name;
+	uint64_t mtime; // see 'mtimes' in directory tables (0 if unknown)
+} iar_dirent_t;
+
+typedef struct {
+	iar_file_t* iar;
+
+	uint64_t node_count;
+	uint64_t* node_offsets;
+	uint64_t index;
+	iar_dirent_t dirent;
+
+	// directory table (version 2 onwards, these all point into the same buffer as 'node_offsets')
+
+	uint64_t subtree_bytes;
+	uint64_t subtree_entries;
+
+	uint64_t* is_dir;
+	uint64_t* sizes;
+	uint64_t* offsets;
+	uint64_t* name_hashes;
+	uint64_t* mtimes; // NULL before version 3
+	uint64_t* name_offsets;
+
+	uint64_t names_offset;
+	uint64_t names_bytes;
+	char* names;
+
+	// for archives without directory tables
+
+	uint8_t* buf;
+	iar_io_op_t* ops; // with backends which batch operations, nodes are read 'IAR_IO_BATCH_OPS' at a time, each into its own slot of 'buf'
+
+	char* name_buf;
+	uint64_t name_capacity;
+} iar_dir_t;
+
+int iar_opendir(iar_file_t* self, iar_dir_t* dir, iar_node_t* node);
+iar_dirent_t* iar_readdir(iar_dir_t* dir); // return the next entry (only valid until the next call) or NULL if there are none left or an error occurred (in which case 'dir->index < dir->node_count')
+void iar_closedir(iar_dir_t* dir);
+
 // functions for writing to iar files
 
 int iar_write_header(iar_file_t* self);
+int iar_patch_path_content(iar_file_t* self, const char* path, const void* buf, uint64_t bytes); // overwrite the content of the file at 'path' in place if the new content fits in its slot (which isn't atomic for concurrent readers), otherwise append it to the end of the archive
 
 // functions for packing and unpacking iar files
 
-int iar_pack(iar_file_t* self, const char* path, const char* name); // if no name is passed (NULL), the name will automatically be generated from the path
+int iar_pack(iar_file_t* self, const char* path, const char* name); // if no name is passed (NULL), the name will automatically be generated from the path (set 'self->base' beforehand for a delta repack)
 int iar_unpack(iar_file_t* self, const char* path);
+int iar_extract(iar_file_t* self, const char* path, const char** entries, size_t entry_count); // only unpack the given entries (paths relative to the root node, see 'iar_find_node_path') to 'path/<entry name>'
 
 #if !defined(WITHOUT_JSON)
 	int iar_pack_json(iar_file_t* self, const char* path, const char* name); // for the name, see above
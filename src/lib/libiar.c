@@ -9,11 +9,24 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h> // for the offsetof macro
 #include <sys/mman.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/param.h> // for the MIN macro
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__linux__)
+	#include <sys/eventfd.h>
+#endif
+
+#if defined(WITH_USDT)
+	#include <sys/sdt.h>
+#endif
 
 #if !defined(WITHOUT_JSON)
 	#include "json.h"
@@ -24,473 +37,5288 @@
 	typedef struct json_object_element_s json_member_t;
 #endif
 
-// functions for opening / closing iar files
+// scratch memory
+// the arena is a list of blocks which are allocated from one after the other & only ever freed all at once, when the operation using them is done
 
-int iar_open_read(iar_file_t* self, const char* path) {
-	self->fp = fopen(path, "rb");
+#define ARENA_BLOCK_BYTES 0x10000 // 64 KiB
 
-	if (!self->fp) {
-		fprintf(stderr, "ERROR Failed to open '%s' for reading\n", path);
+struct iar_arena_s {
+	struct iar_arena_s* prev;
+
+	size_t used;
+	size_t bytes;
+
+	uint8_t data[];
+};
+
+static void* __arena_alloc(iar_file_t* self, size_t bytes) {
+	bytes = (bytes + 15) & ~15; // keep everything aligned
+	struct iar_arena_s* block = self->arena;
+
+	if (!block || block->used + bytes > block->bytes) {
+		size_t const block_bytes = MAX(bytes, ARENA_BLOCK_BYTES);
+		block = malloc(sizeof *block + block_bytes);
+
+		block->prev = self->arena;
+		block->used = 0;
+		block->bytes = block_bytes;
+
+		self->arena = block;
+	}
+
+	void* const ptr = block->data + block->used;
+	block->used += bytes;
+
+	return ptr;
+}
+
+static void __arena_reset(iar_file_t* self, int keep) { // if 'keep' is set, the first block is kept around for the next operation
+	while (self->arena && (!keep || self->arena->prev)) {
+		struct iar_arena_s* const prev = self->arena->prev;
+
+		free(self->arena);
+		self->arena = prev;
+	}
+
+	if (self->arena) {
+		self->arena->used = 0;
+	}
+}
+
+// performance counters
+// these may be added to from several threads at once (scanning, asynchronous requests), hence the atomics
+
+#define STAT_ADD(self, counter, n) __atomic_fetch_add(&(self)->stats.counter, (n), __ATOMIC_RELAXED)
+
+static inline uint64_t __now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void __phase_end(iar_file_t* self, int phase, uint64_t start) {
+	STAT_ADD(self, phase_ns[phase], __now_ns() - start);
+}
+
+const char* iar_phase_name(int phase) {
+	static const char* const names[IAR_PHASE_COUNT] = {
+		[IAR_PHASE_LOOKUP] = "lookup",
+		[IAR_PHASE_SCAN] = "scan",
+		[IAR_PHASE_PACK] = "pack",
+		[IAR_PHASE_UNPACK_WALK] = "unpack_walk",
+		[IAR_PHASE_UNPACK_DATA] = "unpack_data",
+	};
+
+	return phase >= 0 && phase < IAR_PHASE_COUNT ? names[phase] : NULL;
+}
+
+// static probes
+// with 'WITH_USDT' defined, these are USDT probes under the 'iar' provider, which cost a single nop each until something like bpftrace or perf attaches to them (see README.md for the list of probes & their arguments)
+// otherwise, they're compiled out entirely (so arguments mustn't have side effects)
+
+#if defined(WITH_USDT)
+	#define PROBE1(name, a) DTRACE_PROBE1(iar, name, a)
+	#define PROBE2(name, a, b) DTRACE_PROBE2(iar, name, a, b)
+	#define PROBE3(name, a, b, c) DTRACE_PROBE3(iar, name, a, b, c)
+	#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(iar, name, a, b, c, d)
+#else
+	#define PROBE1(name, a)
+	#define PROBE2(name, a, b)
+	#define PROBE3(name, a, b, c)
+	#define PROBE4(name, a, b, c, d)
+#endif
+
+// I/O backends
+// all reads & writes of the archive go through 'self->io', which can be swapped out with 'iar_set_io'
+// backends always read & write everything they're asked to, unless they hit EOF or an error (i.e. they take care of short reads & writes themselves)
+// all offsets are relative to the start of the archive, which isn't necessarily the start of its file (see 'iar_open_read_fd')
+
+// pread/pwrite backend (default for files)
+
+static ssize_t __pread_all(iar_file_t* self, int fd, void* buf, uint64_t bytes, uint64_t offset) {
+	uint64_t done = 0;
+
+	while (done < bytes) {
+		ssize_t const rv = pread(fd, (uint8_t*) buf + done, bytes - done, offset + done);
+		STAT_ADD(self, syscalls, 1);
+
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (rv < 0) {
+			return -1;
+		}
+
+		if (!rv) { // EOF
+			break;
+		}
+
+		done += rv;
+	}
+
+	return done;
+}
+
+static ssize_t __pwrite_all(iar_file_t* self, int fd, const void* buf, uint64_t bytes, uint64_t offset) {
+	uint64_t done = 0;
+
+	while (done < bytes) {
+		ssize_t const rv = pwrite(fd, (uint8_t*) buf + done, bytes - done, offset + done);
+		STAT_ADD(self, syscalls, 1);
+
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (rv <= 0) {
+			return -1;
+		}
+
+		done += rv;
+	}
+
+	return done;
+}
+
+static ssize_t __io_pread_read(iar_file_t* self, void* buf, uint64_t bytes, uint64_t offset) {
+	return __pread_all(self, self->fd, buf, bytes, self->base_offset + offset);
+}
+
+static ssize_t __io_pread_write(iar_file_t* self, const void* buf, uint64_t bytes, uint64_t offset) {
+	return __pwrite_all(self, self->fd, buf, bytes, self->base_offset + offset);
+}
+
+static int __io_pread_size(iar_file_t* self, uint64_t* bytes) {
+	struct stat sb;
+
+	if (fstat(self->fd, &sb) < 0) {
 		return -1;
 	}
 
-	self->absolute_path = realpath(path, NULL);
-	self->fd = fileno(self->fp);
+	*bytes = sb.st_size - self->base_offset;
+	return 0;
+}
+
+static int __io_pread_truncate(iar_file_t* self, uint64_t bytes) {
+	return ftruncate(self->fd, self->base_offset + bytes);
+}
 
-	pread(self->fd, &self->header, sizeof(self->header), 0); // read the iar header
+const iar_io_t iar_io_pread = {
+	.name = "pread",
 
-	if (self->header.magic != IAR_MAGIC) {
-		fprintf(stderr, "ERROR '%s' is not a valid IAR file (magic = 0x%lx)\n", path, self->header.magic);
+	.read = __io_pread_read,
+	.write = __io_pread_write,
+	.size = __io_pread_size,
+	.truncate = __io_pread_truncate,
+};
+
+// memory backend (default for archives in memory)
+// when writing, the buffer grows as needed & is zero-filled, so that gaps read back as zeroes, like holes in a file
+
+static ssize_t __io_mem_read(iar_file_t* self, void* buf, uint64_t bytes, uint64_t offset) {
+	if (offset >= self->mem_bytes) {
+		return 0;
+	}
+
+	bytes = MIN(bytes, self->mem_bytes - offset);
+	memcpy(buf, (uint8_t*) self->mem + offset, bytes);
+
+	STAT_ADD(self, cache_hits, 1);
+
+	return bytes;
+}
+
+static ssize_t __io_mem_write(iar_file_t* self, const void* buf, uint64_t bytes, uint64_t offset) {
+	uint64_t const end = offset + bytes;
+
+	if (end > self->mem_capacity) {
+		if (!self->mem_capacity) {
+			fprintf(stderr, "ERROR Can't write to an archive in memory which was opened for reading\n");
+			return -1;
+		}
+
+		uint64_t const prev_capacity = self->mem_capacity;
+		uint64_t const capacity = MAX(self->mem_capacity * 2, end);
+
+		uint8_t* const mem = realloc(self->mem, capacity);
+
+		if (!mem) {
+			fprintf(stderr, "ERROR Failed to grow archive in memory to %lu bytes\n", capacity);
+			return -1;
+		}
+
+		memset(mem + prev_capacity, 0, capacity - prev_capacity);
+
+		self->mem = mem;
+		self->mem_capacity = capacity;
+	}
+
+	memcpy((uint8_t*) self->mem + offset, buf, bytes);
+	self->mem_bytes = MAX(self->mem_bytes, end);
+
+	return bytes;
+}
+
+static int __io_mem_size(iar_file_t* self, uint64_t* bytes) {
+	*bytes = self->mem_bytes;
+	return 0;
+}
+
+static int __io_mem_truncate(iar_file_t* self, uint64_t bytes) {
+	self->mem_bytes = MIN(self->mem_bytes, bytes);
+	return 0;
+}
+
+static const void* __io_mem_peek(iar_file_t* self, uint64_t offset, uint64_t bytes) {
+	if (offset + bytes > self->mem_bytes) {
+		return NULL;
+	}
+
+	return (uint8_t*) self->mem + offset;
+}
+
+const iar_io_t iar_io_mem = {
+	.name = "mem",
+
+	.read = __io_mem_read,
+	.write = __io_mem_write,
+	.size = __io_mem_size,
+	.truncate = __io_mem_truncate,
+	.peek = __io_mem_peek,
+};
+
+// mmap backend (for reading files)
+// the whole file is mapped when the backend is set up & read from directly, so reads cost no syscalls at all
+// writes still go through pwrite (the mapping is shared, so sees them), as do reads past the end of the mapping
+
+static int __io_mmap_setup(iar_file_t* self) {
+	uint64_t bytes;
+
+	if (__io_pread_size(self, &bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to stat archive (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	self->io_map_bytes = self->base_offset + bytes;
+
+	if (!self->io_map_bytes) { // nothing to map (yet), so everything goes through pread
+		return 0;
+	}
+
+	self->io_map = mmap(NULL, self->io_map_bytes, PROT_READ, MAP_SHARED, self->fd, 0);
+
+	if (self->io_map == MAP_FAILED) {
+		fprintf(stderr, "ERROR Failed to map archive (%s)\n", strerror(errno));
+		self->io_map = NULL;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __io_mmap_teardown(iar_file_t* self) {
+	if (self->io_map) {
+		munmap(self->io_map, self->io_map_bytes);
+	}
+
+	self->io_map = NULL;
+}
+
+static const void* __io_mmap_peek(iar_file_t* self, uint64_t offset, uint64_t bytes) {
+	if (!self->io_map || self->base_offset + offset + bytes > self->io_map_bytes) {
+		return NULL;
+	}
+
+	return (uint8_t*) self->io_map + self->base_offset + offset;
+}
+
+static ssize_t __io_mmap_read(iar_file_t* self, void* buf, uint64_t bytes, uint64_t offset) {
+	const void* const ptr = __io_mmap_peek(self, offset, bytes);
+
+	if (!ptr) {
+		return __io_pread_read(self, buf, bytes, offset);
+	}
+
+	if (bytes) { // 'buf' may be NULL otherwise (e.g. empty directories)
+		memcpy(buf, ptr, bytes);
+	}
+
+	STAT_ADD(self, cache_hits, 1);
+
+	return bytes;
+}
+
+const iar_io_t iar_io_mmap = {
+	.name = "mmap",
+
+	.setup = __io_mmap_setup,
+	.teardown = __io_mmap_teardown,
+
+	.read = __io_mmap_read,
+	.write = __io_pread_write,
+	.size = __io_pread_size,
+	.truncate = __io_pread_truncate,
+	.peek = __io_mmap_peek,
+};
+
+// io_uring backend (Linux only)
+// single reads & writes are no better off going through a ring than with pread/pwrite, so only batches of independent operations do
+// these are all submitted with a single syscall & run concurrently by the kernel, instead of one after the other
+// no liburing; the ring is set up & driven by hand, as the kernel interface is simple enough for what we need of it
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+struct iar_ring_s {
+	int fd;
+	unsigned entries;
+
+	pthread_mutex_t mutex; // the ring is shared, so batches from different threads (e.g. asynchronous requests) take turns
+
+	void* sq_ring;
+	size_t sq_ring_bytes;
+
+	void* cq_ring; // same as 'sq_ring' if the kernel maps both at once
+	size_t cq_ring_bytes;
+
+	struct io_uring_sqe* sqes;
+	size_t sqes_bytes;
+
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+static void __io_uring_teardown(iar_file_t* self) {
+	struct iar_ring_s* const ring = self->io_ring;
+
+	if (!ring) {
+		return;
+	}
+
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_bytes);
+	}
+
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_bytes);
+	}
+
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_bytes);
+	}
+
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->mutex);
+	free(ring);
+
+	self->io_ring = NULL;
+}
+
+static int __io_uring_setup(iar_file_t* self) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof params);
+
+	int const fd = syscall(__NR_io_uring_setup, IAR_IO_BATCH_OPS, &params);
+
+	if (fd < 0) {
+		fprintf(stderr, "ERROR Failed to set up io_uring (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	struct iar_ring_s* const ring = calloc(1, sizeof *ring);
+
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+
+	pthread_mutex_init(&ring->mutex, NULL);
+
+	self->io_ring = ring;
+
+	ring->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_bytes = ring->cq_ring_bytes = MAX(ring->sq_ring_bytes, ring->cq_ring_bytes);
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
 		goto error;
 	}
 
-	if (self->header.version > IAR_VERSION) {
-		fprintf(stderr, "ERROR '%s' is of an unsupported version (%lu) (latest supported version is %lu)\n", path, self->header.version, IAR_VERSION);
+	ring->cq_ring = ring->sq_ring;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto error;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
 		goto error;
 	}
 
-	pread(self->fd, &self->root_node, sizeof(self->root_node), self->header.root_node_offset); // read root node
+	uint8_t* const sq = ring->sq_ring;
+	uint8_t* const cq = ring->cq_ring;
+
+	ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+
+	ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
 	return 0;
 
 error:
 
-	fclose(self->fp);
+	fprintf(stderr, "ERROR Failed to map io_uring (%s)\n", strerror(errno));
+	__io_uring_teardown(self);
+
 	return -1;
 }
 
-int iar_open_write(iar_file_t* self, const char* path) {
-	self->fp = fopen(path, "wb");
+static ssize_t __io_uring_read(iar_file_t* self, void* buf, uint64_t bytes, uint64_t offset) {
+	return __pread_all(self, self->fd, buf, bytes, self->base_offset + offset);
+}
 
-	if (!self->fp) {
-		fprintf(stderr, "ERROR Failed to open '%s' for writing\n", path);
+static ssize_t __io_uring_write(iar_file_t* self, const void* buf, uint64_t bytes, uint64_t offset) {
+	return __pwrite_all(self, self->fd, buf, bytes, self->base_offset + offset);
+}
+
+static int __io_uring_run(iar_file_t* self, iar_io_op_t* ops, size_t count) { // must be called with the ring's mutex held
+	struct iar_ring_s* const ring = self->io_ring;
+
+	for (size_t first = 0; first < count; first += ring->entries) {
+		unsigned const n = MIN(count - first, ring->entries);
+
+		// fill in submission queue entries (we're the only ones submitting, so the tail can be read plainly)
+
+		unsigned tail = *ring->sq_tail;
+
+		for (unsigned i = 0; i < n; i++) {
+			iar_io_op_t* const op = &ops[first + i];
+			unsigned const index = tail & *ring->sq_mask;
+
+			struct io_uring_sqe* const sqe = &ring->sqes[index];
+			memset(sqe, 0, sizeof *sqe);
+
+			sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = op->fd < 0 ? self->fd : op->fd;
+			sqe->off = op->fd < 0 ? self->base_offset + op->offset : op->offset;
+			sqe->addr = (uintptr_t) op->buf;
+			sqe->len = op->bytes;
+			sqe->user_data = first + i;
+
+			ring->sq_array[index] = index;
+			tail++;
+		}
+
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		// submit them all & wait for them all to complete
+
+		unsigned submitted = 0;
+		unsigned completed = 0;
+
+		while (completed < n) {
+			int const rv = syscall(__NR_io_uring_enter, ring->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+			STAT_ADD(self, syscalls, 1);
+
+			if (rv < 0 && errno != EINTR) {
+				fprintf(stderr, "ERROR Failed to submit to io_uring (%s)\n", strerror(errno));
+				return -1;
+			}
+
+			if (rv > 0) {
+				submitted += rv;
+			}
+
+			unsigned head = *ring->cq_head;
+			unsigned const cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+			for (; head != cq_tail; head++) {
+				struct io_uring_cqe* const cqe = &ring->cqes[head & *ring->cq_mask];
+				iar_io_op_t* const op = &ops[cqe->user_data];
+
+				op->rv = cqe->res;
+
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					op->rv = -1;
+				}
+
+				completed++;
+			}
+
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	return 0;
+}
+
+static int __io_uring_batch(iar_file_t* self, iar_io_op_t* ops, size_t count) {
+	struct iar_ring_s* const ring = self->io_ring;
+
+	pthread_mutex_lock(&ring->mutex);
+	int const rv = __io_uring_run(self, ops, count);
+	pthread_mutex_unlock(&ring->mutex);
+
+	if (rv < 0) {
 		return -1;
 	}
 
-	self->absolute_path = realpath(path, NULL);
-	self->fd = fileno(self->fp);
+	// finish off anything which stopped short (which is rare, & never the case at EOF when reading)
 
-	// set defaults (these field can obviously be set after this function has been called)
+	for (size_t i = 0; i < count; i++) {
+		iar_io_op_t* const op = &ops[i];
 
-	self->header.magic = IAR_MAGIC;
-	self->header.version = IAR_VERSION;
-	self->header.page_bytes = IAR_DEFAULT_PAGE_BYTES;
+		if (op->rv <= 0 || (uint64_t) op->rv >= op->bytes) {
+			continue;
+		}
+
+		int const fd = op->fd < 0 ? self->fd : op->fd;
+		uint64_t const offset = (op->fd < 0 ? self->base_offset : 0) + op->offset + op->rv;
+		uint8_t* const buf = (uint8_t*) op->buf + op->rv;
+
+		ssize_t const rv = op->write ?
+			__pwrite_all(self, fd, buf, op->bytes - op->rv, offset) :
+			__pread_all(self, fd, buf, op->bytes - op->rv, offset);
+
+		op->rv = rv < 0 ? -1 : op->rv + rv;
+	}
 
 	return 0;
 }
 
-void iar_close(iar_file_t* self) {
-	free(self->absolute_path);
-	fclose(self->fp);
-}
+const iar_io_t iar_io_uring = {
+	.name = "uring",
+
+	.setup = __io_uring_setup,
+	.teardown = __io_uring_teardown,
+
+	.read = __io_uring_read,
+	.write = __io_uring_write,
+	.size = __io_pread_size,
+	.truncate = __io_pread_truncate,
+	.batch = __io_uring_batch,
+};
+#endif
+
+int iar_set_io(iar_file_t* self, const iar_io_t* io) {
+	if (self->fd < 0 && io != &iar_io_mem) {
+		fprintf(stderr, "ERROR Archives in memory can only use the memory I/O backend\n");
+		return -1;
+	}
+
+	if (io == self->io) {
+		return 0;
+	}
+
+	// backends keep their state in the same slots ('io_map', 'io_ring'), so the previous one has to be torn down before the next one is set up
+
+	const iar_io_t* const prev = self->io;
+
+	if (prev && prev->teardown) {
+		prev->teardown(self);
+	}
+
+	if (io->setup && io->setup(self) < 0) {
+		// go back to the previous backend, or to plain pread/pwrite if even that can't be set up again
+
+		if (prev && prev->setup && prev->setup(self) < 0) {
+			self->io = &iar_io_pread;
+			return -1;
+		}
+
+		self->io = prev;
+		return -1;
+	}
+
+	self->io = io;
+	return 0;
+}
+
+// helpers for the rest of the library
+
+static void __io_batch_stats(iar_file_t* self, iar_io_op_t* ops, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		if (ops[i].fd >= 0 || ops[i].rv <= 0) {
+			continue;
+		}
+
+		if (ops[i].write) {
+			STAT_ADD(self, bytes_written, ops[i].rv);
+		}
+
+		else {
+			STAT_ADD(self, bytes_read, ops[i].rv);
+		}
+	}
+}
+
+static int __io_batch(iar_file_t* self, iar_io_op_t* ops, size_t count) { // run a batch of independent operations, all at once if the backend can
+	if (self->io->batch) {
+		int const rv = self->io->batch(self, ops, count);
+		__io_batch_stats(self, ops, count);
+
+		return rv;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		iar_io_op_t* const op = &ops[i];
+
+		if (op->fd < 0) {
+			op->rv = op->write ?
+				self->io->write(self, op->buf, op->bytes, op->offset) :
+				self->io->read(self, op->buf, op->bytes, op->offset);
+		}
+
+		else {
+			op->rv = op->write ?
+				__pwrite_all(self, op->fd, op->buf, op->bytes, op->offset) :
+				__pread_all(self, op->fd, op->buf, op->bytes, op->offset);
+		}
+	}
+
+	__io_batch_stats(self, ops, count);
+	return 0;
+}
+
+static inline ssize_t __read(iar_file_t* self, void* buf, uint64_t bytes, uint64_t offset) {
+	ssize_t const rv = self->io->read(self, buf, bytes, offset);
+
+	if (rv > 0) {
+		STAT_ADD(self, bytes_read, rv);
+	}
+
+	return rv;
+}
+
+static inline const uint8_t* __peek(iar_file_t* self, uint64_t offset, uint64_t bytes) { // return a pointer straight to the data if the backend can, NULL otherwise
+	return self->io->peek ? self->io->peek(self, offset, bytes) : NULL;
+}
+
+static int __archive_bytes(iar_file_t* self, uint64_t* bytes) {
+	if (self->io->size(self, bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to get size of archive (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __truncate(iar_file_t* self, uint64_t bytes) {
+	self->io->truncate(self, bytes);
+}
+
+static int __write_direct(iar_file_t* self, const void* buf, uint64_t bytes, uint64_t offset) {
+	self->wc_high = MAX(self->wc_high, offset + bytes);
+
+	if (self->io->write(self, buf, bytes, offset) != (ssize_t) bytes) {
+		fprintf(stderr, "ERROR Failed to write to archive (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	STAT_ADD(self, bytes_written, bytes);
+	return 0;
+}
+
+// write combining
+// while packing, writes are collected in a buffer & flushed in large sequential chunks, rather than issuing a syscall for every little node, name & small file
+// gaps between writes (i.e. padding) are zero-filled in the buffer, unless they span a whole filesystem block, in which case they're left as holes
+// 'wc_high' is the end of everything written so far, as we must never zero-fill over something already written
+
+static int __flush(iar_file_t* self) {
+	if (!self->wc_bytes) {
+		return 0;
+	}
+
+	uint64_t const bytes = self->wc_bytes;
+	self->wc_bytes = 0;
+
+	return __write_direct(self, self->wc_buf, bytes, self->wc_offset);
+}
+
+#define HOLE_BYTES 4096 // smallest hole filesystems can be expected to keep track of (i.e. their block size)
+
+static inline int __spans_block(uint64_t start, uint64_t end) { // whether or not there's at least one whole block between 'start' & 'end' which could be left as a hole
+	return ((start + HOLE_BYTES - 1) & ~(HOLE_BYTES - 1)) + HOLE_BYTES <= end;
+}
+
+// mapped writing
+// if the archive has been mapped (see 'pack_map'), anything which falls within the mapping is copied straight into it instead
+// everything behind the last 'IAR_MMAP_FLUSH_BYTES' bytes is regularly handed off to the kernel to write back & dropped from our address space, so that the mapping never takes up more than that in RSS
+
+static inline uint8_t* __map_ptr(iar_file_t* self, uint64_t offset, uint64_t bytes) { // return NULL if not (entirely) within the mapping
+	if (!self->map || offset + bytes > self->map_bytes) {
+		return NULL;
+	}
+
+	return (uint8_t*) self->map + offset;
+}
+
+static void __map_wrote(iar_file_t* self, uint64_t end) {
+	self->wc_high = MAX(self->wc_high, end);
+
+	if (end < self->map_flushed + 2 * IAR_MMAP_FLUSH_BYTES) {
+		return;
+	}
+
+	uint64_t const flush_end = (end - IAR_MMAP_FLUSH_BYTES) & ~((uint64_t) IAR_MMAP_FLUSH_BYTES - 1);
+	uint8_t* const addr = (uint8_t*) self->map + self->map_flushed;
+
+	msync(addr, flush_end - self->map_flushed, MS_ASYNC);
+	madvise(addr, flush_end - self->map_flushed, MADV_DONTNEED); // shared mappings keep their contents in the page cache, so this doesn't lose anything
+
+	self->map_flushed = flush_end;
+}
+
+static int __write(iar_file_t* self, const void* buf, uint64_t bytes, uint64_t offset) {
+	if (!bytes) { // 'buf' may be NULL (e.g. empty directory tables)
+		return 0;
+	}
+
+	uint8_t* const ptr = __map_ptr(self, offset, bytes);
+
+	if (ptr) {
+		memcpy(ptr, buf, bytes);
+		__map_wrote(self, offset + bytes);
+
+		STAT_ADD(self, bytes_written, bytes);
+		STAT_ADD(self, cache_hits, 1);
+
+		return 0;
+	}
+
+	if (self->fd < 0) { // no point in combining writes in memory
+		return __write_direct(self, buf, bytes, offset);
+	}
+
+	uint64_t const wc_end = self->wc_offset + self->wc_bytes;
+
+	if (self->wc_bytes) {
+		// entirely within what's already buffered (this is usually a node being written after its data)
+
+		if (offset >= self->wc_offset && offset + bytes <= wc_end) {
+			memcpy((uint8_t*) self->wc_buf + offset - self->wc_offset, buf, bytes);
+			STAT_ADD(self, cache_hits, 1);
+
+			return 0;
+		}
+
+		// entirely before what's buffered, so order doesn't matter
+
+		if (offset + bytes <= self->wc_offset) {
+			return __write_direct(self, buf, bytes, offset);
+		}
+
+		// after what's buffered & close enough to be appended
+
+		if (offset >= wc_end && wc_end >= self->wc_high && !__spans_block(wc_end, offset) && offset + bytes - self->wc_offset <= IAR_WRITE_COMBINE_BYTES) {
+			memset((uint8_t*) self->wc_buf + self->wc_bytes, 0, offset - wc_end);
+			memcpy((uint8_t*) self->wc_buf + offset - self->wc_offset, buf, bytes);
+
+			self->wc_bytes = offset + bytes - self->wc_offset;
+			STAT_ADD(self, cache_hits, 1);
+
+			return 0;
+		}
+
+		if (__flush(self) < 0) {
+			return -1;
+		}
+	}
+
+	// start buffering anew, if it's worth it & we're not about to write over anything
+
+	if (bytes >= IAR_WRITE_COMBINE_BYTES || offset < self->wc_high) {
+		return __write_direct(self, buf, bytes, offset);
+	}
+
+	if (!self->wc_buf) {
+		self->wc_buf = malloc(IAR_WRITE_COMBINE_BYTES);
+	}
+
+	memcpy(self->wc_buf, buf, bytes);
+
+	self->wc_offset = offset;
+	self->wc_bytes = bytes;
+
+	STAT_ADD(self, cache_hits, 1);
+	return 0;
+}
+
+static inline uint8_t* __io_buf(iar_file_t* self) {
+	if (!self->io_buf) {
+		self->io_buf = malloc(IAR_MAX_READ_BLOCK_SIZE);
+	}
+
+	return self->io_buf;
+}
+
+// pipelining
+// with backends which can batch operations, file data is streamed through two halves of a buffer, one being written out while the other is being read into (in the same batch)
+// each half is 'PIPELINE_BYTES' big, i.e. room for 'IAR_IO_BATCH_OPS / 2' chunks of 'IAR_MAX_READ_BLOCK_SIZE' bytes
+// when unpacking, a half is split into chunks of up to 'IAR_MAX_READ_BLOCK_SIZE' bytes (of one or more files), each read & written out with its own operation, so that at most 'IAR_IO_BATCH_OPS' operations are ever in flight at once
+// when packing, a half is a single stretch of a single file, so it's read & written out with one operation each, i.e. only two are ever in flight at once
+
+#define PIPELINE_CHUNKS (IAR_IO_BATCH_OPS / 2) // per half
+#define PIPELINE_BYTES (PIPELINE_CHUNKS * IAR_MAX_READ_BLOCK_SIZE) // per half
+
+static inline uint8_t* __io_pipeline(iar_file_t* self) {
+	if (!self->io_pipeline) {
+		self->io_pipeline = malloc(2 * PIPELINE_BYTES);
+	}
+
+	return self->io_pipeline;
+}
+
+// functions for opening / closing iar files
+
+static void __init(iar_file_t* self) {
+	self->arena = NULL;
+	self->io_buf = NULL;
+
+	self->wc_buf = NULL;
+	self->wc_bytes = 0;
+	self->wc_high = 0;
+
+	self->map = NULL;
+	self->map_bytes = 0;
+	self->map_flushed = 0;
+
+	self->mem = NULL;
+	self->mem_bytes = 0;
+	self->mem_capacity = 0;
+
+	self->base_offset = 0;
+
+	self->io = NULL;
+	self->io_map = NULL;
+	self->io_ring = NULL;
+	self->io_pipeline = NULL;
+
+	// options are left for the caller to set once the file has been opened
+
+	self->base = NULL;
+	self->trace = NULL;
+	self->layout = NULL;
+	self->scan_threads = 0;
+	self->progress = NULL;
+	self->mmap_write = 0;
+
+	memset(&self->stats, 0, sizeof self->stats);
+}
+
+static int __read_header(iar_file_t* self, const char* name) {
+	if (__read(self, &self->header, sizeof(self->header), 0) != sizeof(self->header)) { // read the iar header
+		fprintf(stderr, "ERROR Failed to read header of '%s'\n", name);
+		return -1;
+	}
+
+	if (self->header.magic != IAR_MAGIC) {
+		fprintf(stderr, "ERROR '%s' is not a valid IAR file (magic = 0x%lx)\n", name, self->header.magic);
+		return -1;
+	}
+
+	if (self->header.version > IAR_VERSION) {
+		fprintf(stderr, "ERROR '%s' is of an unsupported version (%lu) (latest supported version is %lu)\n", name, self->header.version, IAR_VERSION);
+		return -1;
+	}
+
+	if (__read(self, &self->root_node, sizeof(self->root_node), self->header.root_node_offset) != sizeof(self->root_node)) { // read root node
+		fprintf(stderr, "ERROR Failed to read root node of '%s'\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __init_header(iar_file_t* self) {
+	// set defaults (these field can obviously be set after this function has been called)
+
+	self->header.magic = IAR_MAGIC;
+	self->header.version = IAR_VERSION;
+	self->header.page_bytes = IAR_DEFAULT_PAGE_BYTES;
+}
+
+static int __open_existing(iar_file_t* self, const char* path, const char* mode, const char* purpose) {
+	self->fp = fopen(path, mode);
+
+	if (!self->fp) {
+		fprintf(stderr, "ERROR Failed to open '%s' for %s\n", path, purpose);
+		return -1;
+	}
+
+	self->absolute_path = realpath(path, NULL);
+	self->fd = fileno(self->fp);
+
+	__init(self);
+	iar_set_io(self, &iar_io_pread);
+
+	if (__read_header(self, path) < 0) {
+		free(self->absolute_path);
+		fclose(self->fp);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int iar_open_read(iar_file_t* self, const char* path) {
+	return __open_existing(self, path, "rb", "reading");
+}
+
+int iar_open_patch(iar_file_t* self, const char* path) {
+	return __open_existing(self, path, "r+b", "patching");
+}
+
+int iar_open_write(iar_file_t* self, const char* path) {
+	self->fp = fopen(path, "w+b"); // also readable, so that it can be mapped
+
+	if (!self->fp) {
+		fprintf(stderr, "ERROR Failed to open '%s' for writing\n", path);
+		return -1;
+	}
+
+	self->absolute_path = realpath(path, NULL);
+	self->fd = fileno(self->fp);
+
+	__init(self);
+	iar_set_io(self, &iar_io_pread);
+
+	// remember exactly which file we are, so we can make sure not to pack ourselves
+
+	struct stat sb;
+
+	if (fstat(self->fd, &sb) == 0) {
+		self->dev = sb.st_dev;
+		self->ino = sb.st_ino;
+	}
+
+	__init_header(self);
+	return 0;
+}
+
+int iar_open_read_fd(iar_file_t* self, int fd, uint64_t base_offset) {
+	self->absolute_path = NULL;
+
+	self->fp = NULL;
+	self->fd = fd;
+
+	__init(self);
+	self->base_offset = base_offset;
+
+	iar_set_io(self, &iar_io_pread);
+
+	return __read_header(self, "(fd)");
+}
+
+int iar_open_mem_read(iar_file_t* self, const void* ptr, size_t bytes) {
+	self->absolute_path = NULL;
+
+	self->fp = NULL;
+	self->fd = -1;
+
+	__init(self);
+	iar_set_io(self, &iar_io_mem);
+
+	self->mem = (void*) ptr; // never written to, as 'mem_capacity' is 0
+	self->mem_bytes = bytes;
+
+	return __read_header(self, "(memory)");
+}
+
+int iar_open_mem_write(iar_file_t* self) {
+	self->absolute_path = NULL;
+
+	self->fp = NULL;
+	self->fd = -1;
+
+	self->dev = 0;
+	self->ino = 0;
+
+	__init(self);
+	iar_set_io(self, &iar_io_mem);
+
+	self->mem_capacity = IAR_MAX_READ_BLOCK_SIZE;
+	self->mem = calloc(1, self->mem_capacity);
+
+	__init_header(self);
+	return 0;
+}
+
+void iar_close(iar_file_t* self) {
+	__flush(self);
+	free(self->wc_buf);
+
+	__arena_reset(self, 0);
+	free(self->io_buf);
+	free(self->io_pipeline);
+
+	if (self->io->teardown) {
+		self->io->teardown(self);
+	}
+
+	free(self->absolute_path);
+
+	if (self->fp) {
+		fclose(self->fp);
+	}
+
+	if (self->mem_capacity) { // only if it's ours
+		free(self->mem);
+	}
+}
+
+// functions for reading iar files
+
+static int __opendir(iar_file_t* self, iar_dir_t* dir, iar_node_t* node, int with_names);
+static inline uint64_t __hash_name(const char* name);
+static int __dir_table_node(iar_dir_t* dir, uint64_t index, iar_node_t* node);
+
+static uint64_t __find_node_table(iar_file_t* self, iar_dir_t* dir, iar_node_t* node, char const* name, uint64_t* offset_ref, uint64_t* mtime_ref) {
+	// compare name hashes first, and only read the names of the children whose hashes match
+
+	uint64_t const hash = __hash_name(name);
+	uint64_t const name_bytes = strlen(name) + 1;
+
+	char* const name_buf = malloc(name_bytes);
+	uint64_t index = -1;
+
+	for (uint64_t i = 0; i < dir->node_count; i++) {
+		if (dir->name_hashes[i] != hash || dir->name_offsets[i + 1] - dir->name_offsets[i] != name_bytes) {
+			continue;
+		}
+
+		if (__read(self, name_buf, name_bytes, dir->names_offset + dir->name_offsets[i]) != (ssize_t) name_bytes) {
+			fprintf(stderr, "ERROR Failed to read node name\n");
+			break;
+		}
+
+		if (memcmp(name, name_buf, name_bytes) || __dir_table_node(dir, i, node) < 0) {
+			continue;
+		}
+
+		index = i;
+
+		if (offset_ref) {
+			*offset_ref = dir->node_offsets[i];
+		}
+
+		if (mtime_ref) {
+			*mtime_ref = dir->mtimes ? dir->mtimes[i] : 0;
+		}
+
+		break;
+	}
+
+	free(name_buf);
+	return index;
+}
+
+static uint64_t __find_node(iar_file_t* self, iar_node_t* node, char const* name, iar_node_t* parent, uint64_t* offset_ref, uint64_t* mtime_ref) {
+	// the parent is entirely read by '__opendir', so there's no problem if parent == node
+	// we don't need names if there's a directory table, as we can just compare name hashes
+
+	STAT_ADD(self, lookups, 1);
+	iar_dir_t dir;
+
+	if (__opendir(self, &dir, parent, 0) < 0) {
+		return -1;
+	}
+
+	if (self->header.version >= 2) {
+		uint64_t const index = __find_node_table(self, &dir, node, name, offset_ref, mtime_ref);
+
+		iar_closedir(&dir);
+		return index;
+	}
+
+	uint64_t index = -1;
+	iar_dirent_t* dirent;
+
+	while ((dirent = iar_readdir(&dir))) {
+		if (strcmp(name, dirent->name) == 0) {
+			memcpy(node, &dirent->node, sizeof dirent->node);
+			index = dir.index - 1;
+
+			if (offset_ref) {
+				*offset_ref = dirent->offset;
+			}
+
+			if (mtime_ref) {
+				*mtime_ref = 0;
+			}
+
+			break;
+		}
+	}
+
+	iar_closedir(&dir);
+	return index;
+}
+
+uint64_t iar_find_node(iar_file_t* self, iar_node_t* node, char const* name, iar_node_t* parent) {
+	PROBE1(find_node_entry, name);
+
+	uint64_t const start = __now_ns();
+	uint64_t const index = __find_node(self, node, name, parent, NULL, NULL);
+
+	__phase_end(self, IAR_PHASE_LOOKUP, start);
+
+	PROBE4(find_node_return, name, index, index == -1ull ? -1ull : node->data_offset, index == -1ull ? 0 : node->data_bytes);
+	return index;
+}
+
+// access tracing
+// if 'self->trace' is set, every file found by path, read, or mapped is logged to it as a line of tab-separated values: the event ("find", "read" or "map"), the file's data offset, and for "find" its path
+// the data offset is what ties reads & maps back to the path they were found by (see 'self->layout')
+
+static void __trace(iar_file_t* self, const char* event, iar_node_t* node, const char* path) {
+	if (!self->trace || node->is_dir) {
+		return;
+	}
+
+	if (path) {
+		fprintf(self->trace, "%s\t%lu\t%s\n", event, node->data_offset, path);
+	}
+
+	else {
+		fprintf(self->trace, "%s\t%lu\n", event, node->data_offset);
+	}
+}
+
+static uint64_t __find_node_path(iar_file_t* self, iar_node_t* node, const char* path, uint64_t* mtime_ref) {
+	memcpy(node, &self->root_node, sizeof *node);
+	uint64_t offset = self->header.root_node_offset;
+
+	if (mtime_ref) {
+		*mtime_ref = 0;
+	}
+
+	char* const path_buf = strdup(path);
+	char* save_ptr;
+
+	for (char* name = strtok_r(path_buf, "/", &save_ptr); name; name = strtok_r(NULL, "/", &save_ptr)) {
+		if (!node->is_dir) {
+			offset = -1;
+			break;
+		}
+
+		if (__find_node(self, node, name, node, &offset, mtime_ref) == -1ull) {
+			offset = -1;
+			break;
+		}
+	}
+
+	free(path_buf);
+	return offset;
+}
+
+uint64_t iar_find_node_path(iar_file_t* self, iar_node_t* node, const char* path) {
+	PROBE1(find_node_path_entry, path);
+
+	uint64_t const start = __now_ns();
+	uint64_t const offset = __find_node_path(self, node, path, NULL);
+
+	__phase_end(self, IAR_PHASE_LOOKUP, start);
+
+	if (offset != -1ull) {
+		__trace(self, "find", node, path);
+	}
+
+	PROBE4(find_node_path_return, path, offset, offset == -1ull ? -1ull : node->data_offset, offset == -1ull ? 0 : node->data_bytes);
+	return offset;
+}
+
+int iar_read_node_name(iar_file_t* self, iar_node_t* node, char* buf) {
+	return __read(self, buf, node->name_bytes, node->name_offset) == -1;
+}
+
+int iar_node_totals(iar_file_t* self, iar_node_t* node, uint64_t* bytes, uint64_t* entries) {
+	if (!node->is_dir) {
+		*bytes = node->data_bytes;
+		*entries = 0;
+
+		return 0;
+	}
+
+	// directory tables start with the totals, right after the offsets
+
+	if (self->header.version >= 2) {
+		uint64_t totals[2];
+
+		if (__read(self, totals, sizeof totals, node->node_offsets_offset + node->node_count * sizeof(uint64_t)) != sizeof totals) {
+			fprintf(stderr, "ERROR Failed to read subtree totals\n");
+			return -1;
+		}
+
+		*bytes = totals[0];
+		*entries = totals[1];
+
+		return 0;
+	}
+
+	// no directory tables, so we've got no choice but to walk the whole subtree
+
+	iar_dir_t dir;
+
+	if (iar_opendir(self, &dir, node) < 0) {
+		return -1;
+	}
+
+	*bytes = 0;
+	*entries = 0;
+
+	iar_dirent_t* dirent;
+
+	while ((dirent = iar_readdir(&dir))) {
+		uint64_t child_bytes, child_entries;
+
+		if (iar_node_totals(self, &dirent->node, &child_bytes, &child_entries) < 0) {
+			break;
+		}
+
+		*bytes += child_bytes;
+		*entries += child_entries + 1;
+	}
+
+	int const rv = -(dir.index < dir.node_count);
+
+	iar_closedir(&dir);
+	return rv;
+}
+
+int iar_read_node_content /* content not contents */ (iar_file_t* self, iar_node_t* node, char* buf) {
+	if (node->is_dir) {
+		fprintf(stderr, "ERROR Provided node is not a file and thus contains no data\n");
+		return -1;
+	}
+
+	PROBE2(read_node_content_entry, node->data_offset, node->data_bytes);
+
+	__trace(self, "read", node, NULL);
+
+	if (__read(self, buf, node->data_bytes, node->data_offset) != (ssize_t) node->data_bytes) {
+		fprintf(stderr, "ERROR Failed to read node content\n");
+		PROBE2(read_node_content_return, node->data_offset, -1ull);
+
+		return -1;
+	}
+
+	PROBE2(read_node_content_return, node->data_offset, node->data_bytes);
+	return 0;
+}
+
+static int __map_node_content(iar_file_t* self, iar_node_t* node, void* address) {
+	if (node->is_dir) {
+		fprintf(stderr, "ERROR Provided node is not a file and thus contains no data\n");
+		return -1;
+	}
+
+	__trace(self, "map", node, NULL);
+
+	// archives in memory have no file to map, so map some anonymous memory there & copy the content into it instead
+
+	if (self->fd < 0) {
+		if (mmap(address, node->data_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			fprintf(stderr, "ERROR Couldn't map memory (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		if (__read(self, address, node->data_bytes, node->data_offset) != (ssize_t) node->data_bytes) {
+			fprintf(stderr, "ERROR Failed to copy content into memory\n");
+			return -1;
+		}
+
+		if (mprotect(address, node->data_bytes, PROT_READ) < 0) {
+			fprintf(stderr, "ERROR Couldn't make mapped content read-only (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	// file offsets have to be page-aligned to be mapped, which data offsets are only guaranteed to be relative to the start of the archive
+
+	uint64_t const offset = self->base_offset + node->data_offset;
+
+	if (offset % sysconf(_SC_PAGESIZE)) {
+		fprintf(stderr, "ERROR Can't map content at offset %lu in file, as it's not page-aligned (is the archive at a page-aligned offset & aligned to at least the page size?)\n", offset);
+		return -1;
+	}
+
+	if (mmap(address, node->data_bytes, PROT_READ, MAP_PRIVATE | MAP_FIXED, self->fd, offset) == MAP_FAILED) {
+		fprintf(stderr, "ERROR Couldn't map file to memory (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int iar_map_node_content /* content not contents */ (iar_file_t* self, iar_node_t* node, void* address) {
+	PROBE3(map_node_content_entry, node->data_offset, node->data_bytes, address);
+	int const rv = __map_node_content(self, node, address);
+	PROBE4(map_node_content_return, node->data_offset, node->data_bytes, address, rv);
+
+	return rv;
+}
+
+// prefetching & pinning
+// nodes to prefetch are sorted by data offset & ranges close enough together are merged, so that the kernel can read them ahead in as few & as large requests as possible
+
+#define PREFETCH_GAP_BYTES IAR_MAX_READ_BLOCK_SIZE // most bytes between two ranges for them to be merged
+
+static int __prefetch_cmp(const void* _a, const void* _b) {
+	const iar_node_t* a = *(const iar_node_t**) _a;
+	const iar_node_t* b = *(const iar_node_t**) _b;
+
+	return (a->data_offset > b->data_offset) - (a->data_offset < b->data_offset);
+}
+
+static void __prefetch_range(iar_file_t* self, uint64_t start, uint64_t end) {
+	// if the archive is mapped by its backend, ask for the mapping to be paged in
+
+	if (self->io_map && self->base_offset + end <= self->io_map_bytes) {
+		uint64_t const page_bytes = sysconf(_SC_PAGESIZE);
+		uint64_t const aligned = (self->base_offset + start) & ~(page_bytes - 1);
+
+		madvise((uint8_t*) self->io_map + aligned, self->base_offset + end - aligned, MADV_WILLNEED);
+		return;
+	}
+
+	posix_fadvise(self->fd, self->base_offset + start, end - start, POSIX_FADV_WILLNEED);
+}
+
+int iar_prefetch(iar_file_t* self, iar_node_t* nodes, size_t count) {
+	if (self->fd < 0) { // archives in memory are already in memory
+		return 0;
+	}
+
+	iar_node_t** const sorted = malloc(count * sizeof *sorted);
+	size_t file_count = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!nodes[i].is_dir && nodes[i].data_bytes) {
+			sorted[file_count++] = &nodes[i];
+		}
+	}
+
+	qsort(sorted, file_count, sizeof *sorted, __prefetch_cmp);
+
+	uint64_t start = 0;
+	uint64_t end = 0;
+
+	for (size_t i = 0; i < file_count; i++) {
+		iar_node_t* const node = sorted[i];
+
+		if (end && node->data_offset <= end + PREFETCH_GAP_BYTES) {
+			end = MAX(end, node->data_offset + node->data_bytes);
+			continue;
+		}
+
+		if (end) {
+			__prefetch_range(self, start, end);
+		}
+
+		start = node->data_offset;
+		end = node->data_offset + node->data_bytes;
+	}
+
+	if (end) {
+		__prefetch_range(self, start, end);
+	}
+
+	free(sorted);
+	return 0;
+}
+
+int iar_pin_node_content(iar_file_t* self, iar_node_t* node, void* address) {
+	(void) self;
+
+	if (node->is_dir) {
+		fprintf(stderr, "ERROR Provided node is not a file and thus contains no data\n");
+		return -1;
+	}
+
+	if (node->data_bytes && mlock(address, node->data_bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to lock content in memory (%s)%s\n", strerror(errno), errno == ENOMEM || errno == EAGAIN ? " (is 'RLIMIT_MEMLOCK' too low?)" : "");
+		return -1;
+	}
+
+	return 0;
+}
+
+int iar_unpin_node_content(iar_file_t* self, iar_node_t* node, void* address) {
+	(void) self;
+
+	if (node->is_dir) {
+		fprintf(stderr, "ERROR Provided node is not a file and thus contains no data\n");
+		return -1;
+	}
+
+	if (node->data_bytes && munlock(address, node->data_bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to unlock content (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+// functions for reading iar files asynchronously
+// requests are queued in submission order & taken by the first free thread, which does everything a synchronous call would (so lookups can still take several dependent reads)
+// once done, they're moved to the list of completed requests & the fd is signalled
+
+struct iar_async_pool_s {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // signalled when there are new requests (or when closing)
+	pthread_cond_t done_cond; // signalled when requests are completed
+
+	iar_request_t* queue;
+	iar_request_t* queue_tail;
+
+	iar_request_t* done;
+	size_t in_flight; // requests queued, being worked on, or completed but not yet reaped
+
+	int closing;
+	int signal_fd; // end of the eventfd/pipe to signal on
+
+	pthread_t* threads;
+	size_t thread_count;
+};
+
+static void __async_signal(struct iar_async_pool_s* pool) {
+	ssize_t rv;
+
+#if defined(__linux__)
+	uint64_t const one = 1;
+	rv = write(pool->signal_fd, &one, sizeof one);
+#else
+	rv = write(pool->signal_fd, "", 1);
+#endif
+
+	(void) rv; // if the eventfd/pipe is full, it's readable anyway
+}
+
+static void __async_drain(iar_async_t* async) {
+	uint8_t buf[64];
+
+	while (read(async->fd, buf, sizeof buf) > 0);
+}
+
+static void* __async_worker(void* _async) {
+	iar_async_t* const async = _async;
+	struct iar_async_pool_s* const pool = async->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (;;) {
+		while (!pool->queue && !pool->closing) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+
+		if (!pool->queue) { // closing & nothing left to do
+			break;
+		}
+
+		iar_request_t* const request = pool->queue;
+		pool->queue = request->next;
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		// actually process the request
+
+		if (request->type == IAR_REQUEST_READ) {
+			__trace(async->iar, "read", &request->node, NULL);
+			request->rv = -(request->node.is_dir || __read(async->iar, request->buf, request->node.data_bytes, request->node.data_offset) != (ssize_t) request->node.data_bytes);
+		}
+
+		else if (request->type == IAR_REQUEST_FIND) {
+			request->offset = iar_find_node_path(async->iar, &request->node, request->path);
+			request->rv = -(request->offset == -1ull);
+		}
+
+		else {
+			request->rv = -1;
+		}
+
+		// move it to the completed requests
+
+		pthread_mutex_lock(&pool->mutex);
+
+		request->next = pool->done;
+		pool->done = request;
+
+		pthread_cond_broadcast(&pool->done_cond);
+		__async_signal(pool);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+int iar_async_open(iar_file_t* self, iar_async_t* async, size_t threads) {
+	async->iar = self;
+	async->pool = NULL;
+
+	// fd to poll for completions
+
+#if defined(__linux__)
+	async->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int const signal_fd = async->fd;
+
+	if (async->fd < 0) {
+		fprintf(stderr, "ERROR Failed to create eventfd (%s)\n", strerror(errno));
+		return -1;
+	}
+#else
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "ERROR Failed to create pipe (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	async->fd = fds[0];
+	int const signal_fd = fds[1];
+#endif
+
+	// spin up the pool of threads
+
+	struct iar_async_pool_s* const pool = calloc(1, sizeof *pool);
+	async->pool = pool;
+
+	pool->signal_fd = signal_fd;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	pool->threads = malloc(MAX(threads, 1) * sizeof *pool->threads);
+
+	for (; pool->thread_count < MAX(threads, 1); pool->thread_count++) {
+		if (pthread_create(&pool->threads[pool->thread_count], NULL, __async_worker, async)) {
+			break;
+		}
+	}
+
+	if (!pool->thread_count) {
+		fprintf(stderr, "ERROR Failed to create any threads for asynchronous reading\n");
+		iar_async_close(async);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int iar_async_submit(iar_async_t* async, iar_request_t* request) {
+	struct iar_async_pool_s* const pool = async->pool;
+
+	request->next = NULL;
+	request->rv = -1;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->queue) {
+		pool->queue_tail->next = request;
+	}
+
+	else {
+		pool->queue = request;
+	}
+
+	pool->queue_tail = request;
+	pool->in_flight++;
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+size_t iar_async_reap(iar_async_t* async, int wait) {
+	struct iar_async_pool_s* const pool = async->pool;
+
+	// drain the fd before taking the completed requests, so that any completed after that signal it anew
+
+	__async_drain(async);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (wait && !pool->done && pool->in_flight) {
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+
+	iar_request_t* done = pool->done;
+	pool->done = NULL;
+
+	size_t count = 0;
+
+	for (iar_request_t* request = done; request; request = request->next) {
+		count++;
+	}
+
+	pool->in_flight -= count;
+	pthread_mutex_unlock(&pool->mutex);
+
+	// completed requests are pushed to the front of the list, so reverse it to call callbacks in order of completion
+
+	iar_request_t* ordered = NULL;
+
+	while (done) {
+		iar_request_t* const next = done->next;
+
+		done->next = ordered;
+		ordered = done;
+
+		done = next;
+	}
+
+	while (ordered) {
+		iar_request_t* const request = ordered;
+		ordered = request->next; // the callback may well free or resubmit the request
+
+		if (request->callback) {
+			request->callback(request);
+		}
+	}
+
+	return count;
+}
+
+void iar_async_close(iar_async_t* async) {
+	struct iar_async_pool_s* const pool = async->pool;
+
+	if (pool) {
+		// reap everything still in flight (this lets the queue drain first)
+
+		while (pool->in_flight) {
+			iar_async_reap(async, 1);
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->closing = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+
+		for (size_t i = 0; i < pool->thread_count; i++) {
+			pthread_join(pool->threads[i], NULL);
+		}
+
+		free(pool->threads);
+
+		pthread_mutex_destroy(&pool->mutex);
+		pthread_cond_destroy(&pool->cond);
+		pthread_cond_destroy(&pool->done_cond);
+
+		if (pool->signal_fd != async->fd) {
+			close(pool->signal_fd);
+		}
+
+		free(pool);
+		async->pool = NULL;
+	}
+
+	close(async->fd);
+}
+
+// functions for listing iar files
+
+static inline uint64_t __dir_table_words(uint64_t count, uint64_t version) { // size of a directory table (in words) after the offsets and before the names (see 'iar.h')
+	return 2 /* subtree totals */ + (count + 63) / 64 /* is_dir bitmap */ + count * 3 /* sizes, offsets & name hashes */ + (version >= 3 ? count : 0) /* mtimes */ + count + 1 /* name offsets */;
+}
+
+static inline uint64_t __hash_name(const char* name) { // 64-bit FNV-1a
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (; *name; name++) {
+		hash ^= (uint8_t) *name;
+		hash *= 0x100000001B3;
+	}
+
+	return hash;
+}
+
+static int __opendir(iar_file_t* self, iar_dir_t* dir, iar_node_t* node, int with_names) {
+	if (!node->is_dir) {
+		fprintf(stderr, "ERROR Provided node is not a directory\n");
+		return -1;
+	}
+
+	dir->iar = self;
+	dir->index = 0;
+
+	dir->names = NULL;
+	dir->mtimes = NULL;
+	dir->name_buf = NULL;
+	dir->name_capacity = 0;
+	dir->buf = NULL;
+	dir->ops = NULL;
+
+	// read the whole offset table (and the rest of the directory table if there is one) in one go
+
+	dir->node_count = node->node_count;
+	uint64_t table_bytes = dir->node_count * sizeof *dir->node_offsets;
+
+	int const has_table = self->header.version >= 2;
+
+	if (has_table) {
+		table_bytes += __dir_table_words(dir->node_count, self->header.version) * sizeof *dir->node_offsets;
+	}
+
+	dir->node_offsets = malloc(table_bytes);
+
+	if (__read(self, dir->node_offsets, table_bytes, node->node_offsets_offset) != (ssize_t) table_bytes) {
+		fprintf(stderr, "ERROR Failed to read directory table\n");
+		free(dir->node_offsets);
+		return -1;
+	}
+
+	if (!has_table) {
+		size_t const slots = self->io->batch ? IAR_IO_BATCH_OPS : 1;
+		dir->buf = malloc(slots * (sizeof(iar_node_t) + IAR_DIRENT_PREFETCH_BYTES));
+
+		if (self->io->batch) {
+			dir->ops = malloc(IAR_IO_BATCH_OPS * sizeof *dir->ops);
+		}
+
+		return 0;
+	}
+
+	dir->subtree_bytes = dir->node_offsets[dir->node_count];
+	dir->subtree_entries = dir->node_offsets[dir->node_count + 1];
+
+	dir->is_dir = dir->node_offsets + dir->node_count + 2;
+	dir->sizes = dir->is_dir + (dir->node_count + 63) / 64;
+	dir->offsets = dir->sizes + dir->node_count;
+	dir->name_hashes = dir->offsets + dir->node_count;
+	dir->name_offsets = dir->name_hashes + dir->node_count;
+
+	if (self->header.version >= 3) {
+		dir->mtimes = dir->name_offsets;
+		dir->name_offsets += dir->node_count;
+	}
+
+	dir->names_offset = node->node_offsets_offset + table_bytes;
+	dir->names_bytes = dir->name_offsets[dir->node_count];
+
+	if (!with_names) {
+		return 0;
+	}
+
+	// read all the names in one go too
+
+	dir->names = malloc(dir->names_bytes + 1);
+	dir->names[dir->names_bytes] = '\0'; // just to be sure
+
+	if (__read(self, dir->names, dir->names_bytes, dir->names_offset) != (ssize_t) dir->names_bytes) {
+		fprintf(stderr, "ERROR Failed to read directory names\n");
+		iar_closedir(dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+int iar_opendir(iar_file_t* self, iar_dir_t* dir, iar_node_t* node) {
+	return __opendir(self, dir, node, 1);
+}
+
+static int __dir_table_node(iar_dir_t* dir, uint64_t index, iar_node_t* node) {
+	// reconstruct a node from the directory table
+	// its name offset points to the copy of the name in the directory table, which is just as good as the original
+
+	uint64_t const name_offset = dir->name_offsets[index];
+	uint64_t const name_end = dir->name_offsets[index + 1];
+
+	if (name_end <= name_offset || name_end > dir->names_bytes) {
+		fprintf(stderr, "ERROR Directory table is corrupted (name offsets %lu-%lu)\n", name_offset, name_end);
+		return -1;
+	}
+
+	node->is_dir = dir->is_dir[index / 64] >> (index % 64) & 1;
+
+	node->name_bytes = name_end - name_offset;
+	node->name_offset = dir->names_offset + name_offset;
+
+	node->node_count = dir->sizes[index];
+	node->node_offsets_offset = dir->offsets[index];
+
+	return 0;
+}
+
+iar_dirent_t* iar_readdir(iar_dir_t* dir) {
+	if (dir->index >= dir->node_count) {
+		return NULL;
+	}
+
+	iar_file_t* const self = dir->iar;
+	iar_dirent_t* const dirent = &dir->dirent;
+
+	dirent->offset = dir->node_offsets[dir->index];
+	dirent->mtime = dir->mtimes ? dir->mtimes[dir->index] : 0;
+
+	// if we have a directory table, everything's already in memory
+
+	if (dir->names) {
+		if (__dir_table_node(dir, dir->index, &dirent->node) < 0) {
+			return NULL;
+		}
+
+		dirent->name = dir->names + dir->name_offsets[dir->index];
+
+		dir->index++;
+		return dirent;
+	}
+
+	// names are usually written right after their nodes, so read a bit past the node to (hopefully) get both in one read
+	// if the backend can batch operations, read the next 'IAR_IO_BATCH_OPS' nodes like this all at once
+
+	uint64_t const slot_bytes = sizeof dirent->node + IAR_DIRENT_PREFETCH_BYTES;
+
+	uint8_t* buf = dir->buf;
+	ssize_t bytes_read;
+
+	if (dir->ops) {
+		uint64_t const slot = dir->index % IAR_IO_BATCH_OPS;
+
+		if (!slot) {
+			size_t const count = MIN(dir->node_count - dir->index, IAR_IO_BATCH_OPS);
+
+			for (size_t i = 0; i < count; i++) {
+				dir->ops[i] = (iar_io_op_t) {
+					.fd = -1,
+					.buf = dir->buf + i * slot_bytes,
+					.bytes = slot_bytes,
+					.offset = dir->node_offsets[dir->index + i],
+				};
+			}
+
+			if (__io_batch(self, dir->ops, count) < 0) {
+				return NULL;
+			}
+		}
+
+		buf += slot * slot_bytes;
+		bytes_read = dir->ops[slot].rv;
+	}
+
+	else {
+		bytes_read = __read(self, buf, slot_bytes, dirent->offset);
+	}
+
+	if (bytes_read < (ssize_t) sizeof dirent->node) {
+		fprintf(stderr, "ERROR Failed to read node\n");
+		return NULL;
+	}
+
+	memcpy(&dirent->node, buf, sizeof dirent->node);
+
+	uint64_t const buf_end = dirent->offset + bytes_read;
+	uint64_t const name_offset = dirent->node.name_offset;
+	uint64_t const name_bytes = dirent->node.name_bytes;
+
+	if (name_bytes + 1 > dir->name_capacity) {
+		dir->name_capacity = name_bytes + 1;
+		dir->name_buf = realloc(dir->name_buf, dir->name_capacity);
+	}
+
+	if (name_offset >= dirent->offset && name_offset + name_bytes <= buf_end) {
+		memcpy(dir->name_buf, buf + (name_offset - dirent->offset), name_bytes);
+		STAT_ADD(self, cache_hits, 1);
+	}
+
+	else if (__read(self, dir->name_buf, name_bytes, name_offset) != (ssize_t) name_bytes) {
+		fprintf(stderr, "ERROR Failed to read node name\n");
+		return NULL;
+	}
+
+	dir->name_buf[name_bytes] = '\0'; // just to be sure
+	dirent->name = dir->name_buf;
+
+	dir->index++;
+	return dirent;
+}
+
+void iar_closedir(iar_dir_t* dir) {
+	free(dir->node_offsets);
+	free(dir->names);
+	free(dir->name_buf);
+	free(dir->buf);
+	free(dir->ops);
+}
+
+// functions for writing to iar files
+
+int iar_write_header(iar_file_t* self) {
+	return __write_direct(self, &self->header, sizeof(self->header), 0);
+}
+
+typedef struct {
+	uint64_t node_offsets_offset;
+	uint64_t node_count;
+	uint64_t index;
+
+	// offsets of the subtree totals of all the directories the node to be patched is in
+
+	uint64_t* ancestor_totals;
+	uint64_t ancestor_count;
+} patch_parent_t;
+
+static uint64_t __patch_resolve(iar_file_t* self, const char* path, iar_node_t* node, patch_parent_t* parent) {
+	// like '__find_node_path', but keep track of the directories the path goes through along the way, as their tables need updating too
+
+	memcpy(node, &self->root_node, sizeof *node);
+	uint64_t offset = self->header.root_node_offset;
+
+	char* const path_buf = strdup(path);
+	char* save_ptr;
+
+	for (char* name = strtok_r(path_buf, "/", &save_ptr); name; name = strtok_r(NULL, "/", &save_ptr)) {
+		if (!node->is_dir) {
+			offset = -1;
+			break;
+		}
+
+		iar_node_t dir_node = *node;
+		uint64_t const index = __find_node(self, node, name, &dir_node, &offset, NULL);
+
+		if (index == -1ull) {
+			offset = -1;
+			break;
+		}
+
+		parent->node_offsets_offset = dir_node.node_offsets_offset;
+		parent->node_count = dir_node.node_count;
+		parent->index = index;
+
+		parent->ancestor_totals = realloc(parent->ancestor_totals, (parent->ancestor_count + 1) * sizeof *parent->ancestor_totals);
+		parent->ancestor_totals[parent->ancestor_count++] = dir_node.node_offsets_offset + dir_node.node_count * sizeof(uint64_t);
+	}
+
+	free(path_buf);
+	return offset;
+}
+
+static uint64_t __patch_slot_end(iar_file_t* self, iar_node_t* node, patch_parent_t* parent) {
+	// the node's data slot extends over the padding after its data, up until the next page boundary (where the next file's data would start)
+	// nodes, names & directory tables aren't aligned though, so anything of those which comes before then cuts it short:
+	// - in the tree order things are packed in, that's the next entry in the same directory, or the directory's own table if the node was its last entry
+	// - otherwise (e.g. after files packed according to a layout, or previously appended content), the padding is checked to still be all zeros, which no node (nor anything after one) is
+	// if there's nothing after it, it's the last thing in the archive and can grow as much as it likes
+
+	uint64_t const data_end = node->data_offset + node->data_bytes;
+	uint64_t slot_end = (data_end + self->header.page_bytes - 1) & ~(self->header.page_bytes - 1);
+
+	uint64_t archive_bytes;
+
+	if (__archive_bytes(self, &archive_bytes) < 0) {
+		return data_end;
+	}
+
+	int const is_last = archive_bytes <= slot_end;
+	slot_end = MIN(slot_end, archive_bytes);
+
+	#define SLOT_CANDIDATE(candidate) \
+		if ((candidate) >= data_end && (candidate) < slot_end) { \
+			slot_end = (candidate); \
+		}
+
+	if (parent->ancestor_count) {
+		SLOT_CANDIDATE(parent->node_offsets_offset)
+
+		iar_node_t parent_node = {
+			.is_dir = 1,
+			.node_count = parent->node_count,
+			.node_offsets_offset = parent->node_offsets_offset,
+		};
+
+		iar_dir_t dir;
+
+		if (__opendir(self, &dir, &parent_node, 0) < 0) {
+			return data_end;
+		}
+
+		for (uint64_t i = 0; i < dir.node_count; i++) {
+			SLOT_CANDIDATE(dir.node_offsets[i])
+		}
+
+		iar_closedir(&dir);
+	}
+
+	#undef SLOT_CANDIDATE
+
+	uint8_t* const block = __io_buf(self);
+
+	for (uint64_t offset = data_end; offset < slot_end; offset += IAR_MAX_READ_BLOCK_SIZE) {
+		uint64_t const bytes = MIN(slot_end - offset, IAR_MAX_READ_BLOCK_SIZE);
+
+		if (__read(self, block, bytes, offset) != (ssize_t) bytes) {
+			return data_end;
+		}
+
+		for (uint64_t i = 0; i < bytes; i++) {
+			if (block[i]) {
+				return data_end;
+			}
+		}
+	}
+
+	return is_last && slot_end == archive_bytes ? -1ull : slot_end;
+}
+
+static int __patch_append(iar_file_t* self, iar_node_t* node);
+
+int iar_patch_path_content(iar_file_t* self, const char* path, const void* buf, uint64_t bytes) {
+	int rv = -1;
+
+	patch_parent_t parent = { 0 };
+	iar_node_t node;
+
+	uint64_t const node_offset = __patch_resolve(self, path, &node, &parent);
+
+	if (node_offset == -1ull) {
+		fprintf(stderr, "ERROR Couldn't find '%s' in archive\n", path);
+		goto error;
+	}
+
+	if (node.is_dir) {
+		fprintf(stderr, "ERROR '%s' is not a file and thus contains no data\n", path);
+		goto error;
+	}
+
+	uint64_t const slot_end = __patch_slot_end(self, &node, &parent);
+	uint64_t const prev_data_bytes = node.data_bytes;
+
+	// if the new content fits in the node's slot, it's overwritten in place
+	// this isn't atomic: a concurrent reader may see a mix of the old & new content (and, going by the old size, the old content's tail)
+	// otherwise, the data is written before the node, so that the node never points to data which hasn't been written yet
+
+	int const in_place = bytes <= slot_end - node.data_offset;
+
+	if (!in_place && __patch_append(self, &node) < 0) {
+		goto error;
+	}
+
+	if (__write_direct(self, buf, bytes, node.data_offset) < 0) {
+		goto error;
+	}
+
+	node.data_bytes = bytes;
+
+	if (__write_direct(self, &node, sizeof node, node_offset) < 0) {
+		goto error;
+	}
+
+	// if the content shrunk in place, zero what's left of the old content after it, so that the slot can still be grown back into later on (see '__patch_slot_end')
+
+	if (in_place && bytes < prev_data_bytes) {
+		uint64_t const zeros_bytes = MIN(prev_data_bytes - bytes, IAR_MAX_READ_BLOCK_SIZE);
+		void* const zeros = calloc(1, zeros_bytes);
+
+		for (uint64_t offset = node.data_offset + bytes; offset < node.data_offset + prev_data_bytes; offset += zeros_bytes) {
+			if (__write_direct(self, zeros, MIN(node.data_offset + prev_data_bytes - offset, zeros_bytes), offset) < 0) {
+				free(zeros);
+				goto error;
+			}
+		}
+
+		free(zeros);
+	}
+
+	// the parent's directory table has copies of the size & offset too, so update those
+	// its recorded mtime no longer describes the data either, so clear it so that nothing gets reused from it when repacking
+	// all the directories the node is in also need their subtree totals updated
+
+	if (self->header.version < 2 || !parent.node_count) {
+		goto success;
+	}
+
+	uint64_t const n = parent.node_count;
+	uint64_t const sizes_offset = parent.node_offsets_offset + (n + 2 + (n + 63) / 64 + parent.index) * sizeof(uint64_t);
+	uint64_t const offsets_offset = sizes_offset + n * sizeof(uint64_t);
+	uint64_t const mtimes_offset = offsets_offset + 2 * n * sizeof(uint64_t);
+
+	if (
+		__write_direct(self, &node.data_bytes, sizeof node.data_bytes, sizes_offset) < 0 ||
+		__write_direct(self, &node.data_offset, sizeof node.data_offset, offsets_offset) < 0
+	) {
+		goto error;
+	}
+
+	uint64_t const no_mtime = 0;
+
+	if (self->header.version >= 3 && __write_direct(self, &no_mtime, sizeof no_mtime, mtimes_offset) < 0) {
+		goto error;
+	}
+
+	for (uint64_t i = 0; i < parent.ancestor_count; i++) {
+		uint64_t subtree_bytes;
+
+		if (__read(self, &subtree_bytes, sizeof subtree_bytes, parent.ancestor_totals[i]) != sizeof subtree_bytes) {
+			fprintf(stderr, "ERROR Failed to read subtree totals\n");
+			goto error;
+		}
+
+		subtree_bytes = subtree_bytes - prev_data_bytes + bytes;
+
+		if (__write_direct(self, &subtree_bytes, sizeof subtree_bytes, parent.ancestor_totals[i]) < 0) {
+			goto error;
+		}
+	}
+
+success:
+
+	rv = 0;
+
+error:
+
+	free(parent.ancestor_totals);
+	return rv;
+}
+
+// functions for packing and unpacking iar files
+// TODO 'uint64_t' vs 'int' for return types?
+
+typedef struct {
+	uint64_t bytes; // total size of all file data
+	uint64_t entries; // total number of nodes (not including the directory itself)
+	uint64_t mtime; // of files, to be recorded in their parent's directory table (0 for directories, or if unknown)
+} subtree_totals_t;
+
+// directories are always scanned in full & their entries sorted before being packed, so that the output doesn't depend on the order 'readdir' happens to return them in
+// this can either happen as they're being packed, or all at once beforehand by a pool of threads (in which case the result is a tree of scanned directories, the manifest)
+
+typedef struct scan_dir_s scan_dir_t;
+
+typedef struct {
+	char* name;
+	int is_dir;
+
+	scan_dir_t* dir; // if scanned beforehand
+
+	// when scanning beforehand, entries are stat'ed by the scanning threads, so that they don't have to be stat'ed again when packing (& so that the archive's layout can be planned)
+
+	int has_stat;
+
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t mtime; // in nanoseconds since the epoch
+} scan_entry_t;
+
+// if a directory has so many entries that they don't fit within 'IAR_DIR_TABLE_MAX_MEMORY' either, they're sorted in runs which are spilled to temporary files, and merged back together as they're packed
+// (this isn't possible when scanning beforehand, as the whole tree has to be in memory for the archive's layout to be planned)
+
+typedef struct {
+	FILE* file;
+
+	int done;
+	scan_entry_t entry; // next entry of the run
+	char* name;
+	size_t name_capacity;
+} scan_run_t;
+
+typedef struct {
+	scan_run_t* runs;
+	size_t run_count;
+
+	scan_entry_t entry; // entry last taken from the runs, whose name has to stay valid until the next one is taken
+	char* name;
+	size_t name_capacity;
+} scan_spill_t;
+
+struct scan_dir_s {
+	scan_entry_t* entries; // NULL if spilled
+	size_t entry_count;
+
+	char* names;
+	scan_spill_t* spill;
+};
+
+static int scan_dir(DIR* dp, scan_dir_t* dir, int with_stat);
+static scan_entry_t* scan_dir_next(scan_dir_t* dir, size_t* index); // return the next entry in order or NULL if there are none left or reading spilled entries failed (in which case '*index < dir->entry_count')
+static void scan_dir_free(scan_dir_t* dir);
+static int scan_tree(iar_file_t* self, const char* path, scan_dir_t* root);
+
+// state for the whole of a pack walk
+// directories being packed are kept on an explicit stack of frames rather than the call stack, so that arbitrarily deep trees can be packed
+// only the directories of the last 'IAR_MAX_OPEN_DIRS' frames or so are kept open; the others are closed & reopened relative to their nearest open ancestor when we get back to them
+
+typedef struct dir_table_s dir_table_t;
+
+typedef struct {
+	char* path; // relative to the root, e.g. "dir/file"
+	size_t rank; // order of first access
+
+	int packed;
+	uint64_t offset;
+	iar_node_t node;
+	uint64_t mtime;
+} pack_layout_t;
+
+typedef struct {
+	DIR* dp; // NULL if closed
+	const char* path; // relative to the parent directory (or to 'root_fd' for the bottom frame)
+	const char* name;
+	int root_fd;
+
+	uint64_t offset;
+	iar_node_t node;
+
+	// the corresponding directory in the base archive (if any) is read through alongside this one's entries, as both are sorted by name
+
+	int has_base; // whether 'base_dir' is open
+	int base_pending; // whether its current entry is yet to be matched
+	iar_dir_t base_dir;
+
+	scan_dir_t* scan; // if scanned beforehand, otherwise 'local_scan' is used
+	scan_dir_t local_scan;
+
+	dir_table_t* table;
+	size_t index; // of the next entry to be packed
+} pack_frame_t;
+
+typedef struct {
+	dir_table_t** tables;
+	size_t table_count;
+	size_t depth;
+
+	pack_frame_t* frames;
+	size_t frame_count;
+	size_t frames_capacity;
+
+	size_t open_dirs;
+
+	// files from the access trace in 'self->layout', sorted by path once they've been packed
+
+	pack_layout_t* layout;
+	size_t layout_count;
+
+	char* layout_path; // scratch buffer for building paths to look up
+	size_t layout_path_capacity;
+} pack_state_t;
+
+static void __pack_state_free(pack_state_t* state);
+
+static uint64_t pack_walk(iar_file_t* self, pack_state_t* state, iar_node_t* node, subtree_totals_t* totals, int dir_fd, const char* path, const char* name, int is_dir, scan_dir_t* scan, iar_node_t* base_node); // return offset, -1 if failure, -2 if file to be ignored
+static uint64_t pack_plan(iar_file_t* self, scan_dir_t* root, const char* name, int* alloc_errno); // return the planned size of the archive
+static void __layout_parse(iar_file_t* self, pack_state_t* state);
+static int __layout_pack(iar_file_t* self, pack_state_t* state, const char* path);
+static int pack_map(iar_file_t* self, uint64_t bytes);
+static int pack_unmap(iar_file_t* self);
+// unpacking happens in two steps:
+// first, the node tree is walked, creating all directories & collecting all files to be written
+// then, those files are sorted by data offset & written out, so that the archive is only ever read going forwards
+// everything is created relative to its parent directory rather than by path, so that arbitrarily deep trees can be unpacked
+// only the last 'IAR_MAX_OPEN_DIRS' directories opened are kept open; the others are reopened relative to their nearest open ancestor when needed again
+
+#define UNPACK_OUTPUT ((size_t) -1) // parent of the output directory
+
+typedef struct {
+	size_t parent; // index of the parent directory, or 'UNPACK_OUTPUT' for the output directory itself (whose name is then its path)
+	char* name;
+	int fd; // -1 if closed
+} unpack_dir_t;
+
+typedef struct {
+	size_t dir; // index of the directory it's in
+	char* name;
+
+	uint64_t data_offset;
+	uint64_t data_bytes;
+} unpack_job_t;
+
+typedef struct {
+	unpack_job_t* jobs;
+
+	size_t job_count;
+	size_t jobs_capacity;
+
+	uint64_t total_bytes;
+
+	unpack_dir_t* dirs;
+
+	size_t dir_count;
+	size_t dirs_capacity;
+
+	size_t open_dirs[IAR_MAX_OPEN_DIRS]; // ring of the directories which are open, oldest first from 'open_next' once it's full
+	size_t open_count;
+	size_t open_next;
+
+	size_t* chain; // scratch buffer for reopening directories
+	size_t chain_capacity;
+} unpack_plan_t;
+
+static int unpack_walk(iar_file_t* self, const char* path, iar_node_t* node, unpack_plan_t* plan);
+static int unpack_plan_run(iar_file_t* self, unpack_plan_t* plan); // this frees the plan
+static void unpack_plan_free(unpack_plan_t* plan);
+
+#if !defined(WITHOUT_JSON)
+	static uint64_t pack_json_walk(iar_file_t* self, pack_state_t* state, iar_node_t* node, subtree_totals_t* totals, json_value_t* member, const char* name); // return offset, -1 if failure, -2 if file to be ignored
+#endif
+
+// get the last bit of path & use that as a name (if user doesn't specify a name himself)
+// a bit ugly but it gets the job done
+
+static inline char* __iar_pack_gen_name(const char* path, const char* _name) {
+	if (_name) {
+		return strdup(++_name); // so we have something to free
+	}
+
+	char* abs_path = realpath(path, NULL);
+	char* name = abs_path + strlen(abs_path) - 1; // go to end of absolute path
+
+	for (; name >= abs_path && *name != '/'; name--); // move backwards until we find a path delimiter or we reach the beginning of the absolute path
+
+	name = strdup(++name);
+	free(abs_path);
+
+	return name;
+}
+
+int iar_pack(iar_file_t* self, const char* path, const char* _name) {
+	char* name = __iar_pack_gen_name(path, _name);
+
+	// if we're doing a delta repack, files are compared against the mtimes recorded in the base's directory tables to know which have been modified since
+
+	pack_state_t state = { 0 };
+	iar_node_t* const base_node = self->base ? &self->base->root_node : NULL;
+
+	// scan the whole tree beforehand if we've been asked to do so with multiple threads
+
+	scan_dir_t* scan = NULL;
+	scan_dir_t root_scan = { 0 };
+
+	if (self->scan_threads > 1) {
+		uint64_t const scan_start = __now_ns();
+		int const rv = scan_tree(self, path, &root_scan);
+
+		__phase_end(self, IAR_PHASE_SCAN, scan_start);
+
+		if (rv < 0) {
+			scan_dir_free(&root_scan);
+			free(name);
+
+			return -1;
+		}
+
+		if (rv > 0) { // root is a directory
+			scan = &root_scan;
+		}
+	}
+
+	uint64_t const start = __now_ns();
+
+	// if we know what the whole tree looks like, we can allocate the whole archive on disk beforehand
+	// (the plan only knows how to lay things out in the order of the walk, so not if they're to be laid out according to a trace)
+
+	uint64_t planned_bytes = 0;
+	int alloc_errno = 0;
+
+	if (scan && !self->layout) {
+		planned_bytes = pack_plan(self, scan, name, &alloc_errno);
+	}
+
+	if (self->mmap_write && !planned_bytes) {
+		fprintf(stderr, "WARNING Can't write the archive through a mapping without knowing its size beforehand (which needs 'scan_threads' > 1, a directory to pack, and no layout); falling back to regular writes\n");
+	}
+
+	// a mapping of space which isn't allocated would only find out there's none left when writing to it faults (SIGBUS), so only map what's been allocated
+	// running out of space fails the pack either way, so might as well do so before writing anything
+
+	int map = self->mmap_write && self->fd >= 0 && planned_bytes;
+
+	if (alloc_errno == ENOSPC) {
+		fprintf(stderr, "ERROR Not enough space for the archive (%lu bytes)\n", planned_bytes);
+	}
+
+	else if (map && alloc_errno) {
+		fprintf(stderr, "WARNING Failed to allocate the archive beforehand (%s), so it can't safely be written through a mapping; falling back to regular writes\n", strerror(alloc_errno));
+		map = 0;
+	}
+
+	if (alloc_errno == ENOSPC || (map && pack_map(self, planned_bytes) < 0)) {
+		__phase_end(self, IAR_PHASE_PACK, start);
+		__pack_state_free(&state);
+		scan_dir_free(&root_scan);
+		free(name);
+
+		return -1;
+	}
+
+	self->current_offset = sizeof(self->header);
+
+	// pack the files in the access trace first
+
+	if (self->layout) {
+		__layout_parse(self, &state);
+
+		if (__layout_pack(self, &state, path) < 0) {
+			__phase_end(self, IAR_PHASE_PACK, start);
+			__pack_state_free(&state);
+			scan_dir_free(&root_scan);
+			free(name);
+
+			return -1;
+		}
+	}
+
+	// walk
+
+	iar_node_t root_node;
+	subtree_totals_t root_totals;
+
+	int error = (self->header.root_node_offset = pack_walk(self, &state, &root_node, &root_totals, AT_FDCWD, path, name, !!scan, scan, base_node)) == -1ull;
+
+	error |= __flush(self) < 0;
+	error |= pack_unmap(self) < 0;
+
+	// if the tree changed since it was scanned, we may have allocated too much, so give back what we didn't use
+
+	if (planned_bytes > self->wc_high) {
+		__truncate(self, self->wc_high);
+	}
+
+	__phase_end(self, IAR_PHASE_PACK, start);
+	__pack_state_free(&state);
+	scan_dir_free(&root_scan);
+	free(name);
+
+	return -error;
+}
+
+#if !defined(WITHOUT_JSON)
+
+int iar_pack_json(iar_file_t* self, const char* path, const char* _name) {
+	char* name = __iar_pack_gen_name(path, _name);
+
+	int rv = -1;
+
+	FILE* fp = fopen(path, "rb");
+
+	if (!fp) {
+		fprintf(stderr, "ERROR Failed to open '%s'\n", path);
+		goto error;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size_t bytes = ftell(fp);
+
+	char* raw = malloc(bytes + 1);
+	raw[bytes] = '\0'; // just to be sure
+
+	rewind(fp);
+	fread(raw, 1, bytes, fp);
+
+	fclose(fp);
+
+	json_value_t* json = json_parse(raw, strlen(raw));
+
+	if (!json) {
+		fprintf(stderr, "ERROR Failed to parse JSON\n");
+		goto error_json;
+	}
+
+	self->current_offset = sizeof(self->header);
+	pack_state_t state = { 0 };
+
+	iar_node_t root_node;
+	subtree_totals_t root_totals;
+
+	self->header.root_node_offset = pack_json_walk(self, &state, &root_node, &root_totals, json, name);
+	__pack_state_free(&state);
+
+	if (__flush(self) < 0 || self->header.root_node_offset == -1ull) {
+		goto error_json;
+	}
+
+	rv = 0; // success
+
+error_json:
+
+	free(json);
+
+error:
+
+	free(name);
+	return rv;
+}
+
+#endif
+
+static int __unpack_check_space(const char* path, uint64_t bytes) {
+	struct statvfs sb;
+
+	if (statvfs(path, &sb) < 0) {
+		return 0; // not being able to check isn't reason enough to fail
+	}
+
+	uint64_t const avail = (uint64_t) sb.f_bavail * sb.f_frsize;
+
+	if (bytes > avail) {
+		fprintf(stderr, "ERROR Not enough space to unpack to '%s' (%lu bytes needed, %lu bytes available)\n", path, bytes, avail);
+		return -1;
+	}
+
+	return 0;
+}
+
+int iar_unpack(iar_file_t* self, const char* path) {
+	mkdir(path, 0700);
+
+	uint64_t bytes, entries;
+
+	if (iar_node_totals(self, &self->root_node, &bytes, &entries) < 0 || __unpack_check_space(path, bytes) < 0) {
+		return -1;
+	}
+
+	unpack_plan_t plan = { 0 };
+	int rv = -1;
+
+	if (unpack_walk(self, path, &self->root_node, &plan) < 0) {
+		unpack_plan_free(&plan);
+	}
+
+	else {
+		rv = unpack_plan_run(self, &plan);
+	}
+
+	__arena_reset(self, 1);
+	return rv;
+}
+
+typedef struct {
+	uint64_t offset;
+	iar_node_t node;
+} extract_entry_t;
+
+static int __extract_entry_cmp(const void* _a, const void* _b) {
+	const extract_entry_t* a = _a;
+	const extract_entry_t* b = _b;
+
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+int iar_extract(iar_file_t* self, const char* path, const char** entries, size_t entry_count) {
+	int rv = -1;
+
+	// resolve all entries first, so that we can extract them in the order in which they appear in the archive
+	// nodes come right before their data (or their children for directories), so sorting by node offset keeps reads going forwards
+
+	extract_entry_t* const resolved = malloc((entry_count + 1) * sizeof *resolved);
+
+	for (size_t i = 0; i < entry_count; i++) {
+		resolved[i].offset = iar_find_node_path(self, &resolved[i].node, entries[i]);
+
+		if (resolved[i].offset == -1ull) {
+			fprintf(stderr, "ERROR Couldn't find '%s' in archive\n", entries[i]);
+			goto error;
+		}
+	}
+
+	qsort(resolved, entry_count, sizeof *resolved, __extract_entry_cmp);
+
+	// make sure we've got enough space for everything
+
+	mkdir(path, 0700);
+	uint64_t total_bytes = 0;
+
+	for (size_t i = 0; i < entry_count; i++) {
+		uint64_t bytes, entries;
+
+		if (iar_node_totals(self, &resolved[i].node, &bytes, &entries) < 0) {
+			goto error;
+		}
+
+		total_bytes += bytes;
+	}
+
+	if (__unpack_check_space(path, total_bytes) < 0) {
+		goto error;
+	}
+
+	// actually extract
+	// all files of all entries are written out together, so that the archive is read in one forward pass
+	unpack_plan_t plan = { 0 };
+
+	for (size_t i = 0; i < entry_count; i++) {
+		if (unpack_walk(self, path, &resolved[i].node, &plan) < 0) {
+			unpack_plan_free(&plan);
+			goto error;
+		}
+	}
+
+	rv = unpack_plan_run(self, &plan);
+
+error:
+
+	__arena_reset(self, 1);
+	free(resolved);
+
+	return rv;
+}
+
+// static functions
+
+#define NODE_OFFSET(node) \
+	(node).data_offset = (self->current_offset & ~(self->header.page_bytes - 1)) + self->header.page_bytes; \
+	self->current_offset = (node).data_offset;
+
+// directory tables are built up as child nodes are packed, and written out once they all have been (see 'iar.h' for the layout)
+// if a directory has so many entries that its table doesn't fit within 'IAR_DIR_TABLE_MAX_MEMORY', the entries which don't are spilled to temporary files
+
+typedef struct {
+	uint64_t node_offset;
+	uint64_t size;
+	uint64_t offset;
+	uint64_t name_hash;
+	uint64_t mtime;
+	uint64_t name_offset;
+} dir_table_record_t;
+
+struct dir_table_s {
+	uint64_t count;
+	subtree_totals_t totals;
+
+	// the is_dir bitmap is tiny, so it's always entirely in memory
+
+	uint64_t* is_dir;
+	uint64_t is_dir_capacity;
+
+	// the last 'mem_count' entries (& their names) are in memory, everything before that has been spilled
+
+	uint64_t mem_count;
+	uint64_t capacity;
+
+	uint64_t* node_offsets;
+	uint64_t* sizes;
+	uint64_t* offsets;
+	uint64_t* name_hashes;
+	uint64_t* mtimes;
+	uint64_t* name_offsets; // these are relative to the start of *all* the names
+
+	char* names;
+	uint64_t names_bytes;
+	uint64_t mem_names_bytes;
+	uint64_t names_capacity;
+
+	FILE* spill; // 'dir_table_record_t's
+	FILE* spill_names;
+};
+
+static inline uint64_t __dir_table_mem_bytes(uint64_t capacity, uint64_t names_capacity) {
+	return capacity * sizeof(dir_table_record_t) + names_capacity;
+}
+
+static int __dir_table_spill(dir_table_t* table) {
+	if (!table->spill) {
+		table->spill = tmpfile();
+		table->spill_names = tmpfile();
+
+		if (!table->spill || !table->spill_names) {
+			fprintf(stderr, "ERROR Failed to create temporary files for directory table (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	for (uint64_t i = 0; i < table->mem_count; i++) {
+		dir_table_record_t const record = {
+			.node_offset = table->node_offsets[i],
+			.size = table->sizes[i],
+			.offset = table->offsets[i],
+			.name_hash = table->name_hashes[i],
+			.mtime = table->mtimes[i],
+			.name_offset = table->name_offsets[i],
+		};
+
+		if (fwrite(&record, sizeof record, 1, table->spill) != 1) {
+			goto error;
+		}
+	}
+
+	if (fwrite(table->names, 1, table->mem_names_bytes, table->spill_names) != table->mem_names_bytes) {
+		goto error;
+	}
+
+	table->mem_count = 0;
+	table->mem_names_bytes = 0;
+
+	return 0;
+
+error:
+
+	fprintf(stderr, "ERROR Failed to spill directory table to temporary file (%s)\n", strerror(errno));
+	return -1;
+}
+
+static int __dir_table_add(dir_table_t* table, uint64_t offset, iar_node_t* node, subtree_totals_t* totals, const char* name) {
+	uint64_t const name_bytes = strlen(name) + 1;
+
+	// if we'd have to grow past our memory budget, spill everything we've got in memory instead
+
+	uint64_t capacity = table->capacity;
+	uint64_t names_capacity = table->names_capacity;
+
+	if (table->mem_count >= capacity) {
+		capacity = capacity ? capacity * 2 : 16;
+	}
+
+	if (table->mem_names_bytes + name_bytes > names_capacity) {
+		names_capacity = MAX(names_capacity * 2, table->mem_names_bytes + name_bytes);
+	}
+
+	if (
+		(capacity != table->capacity || names_capacity != table->names_capacity) &&
+		table->mem_count && __dir_table_mem_bytes(capacity, names_capacity) > IAR_DIR_TABLE_MAX_MEMORY
+	) {
+		if (__dir_table_spill(table) < 0) {
+			return -1;
+		}
+
+		capacity = MAX(table->capacity, 1);
+		names_capacity = MAX(table->names_capacity, name_bytes);
+	}
+
+	if (capacity != table->capacity) {
+		table->capacity = capacity;
+
+		#define GROW(array) (table->array) = realloc((table->array), table->capacity * sizeof *(table->array));
+
+		GROW(node_offsets)
+		GROW(sizes)
+		GROW(offsets)
+		GROW(name_hashes)
+		GROW(mtimes)
+		GROW(name_offsets)
+
+		#undef GROW
+	}
+
+	if (names_capacity != table->names_capacity) {
+		table->names_capacity = names_capacity;
+		table->names = realloc(table->names, table->names_capacity);
+	}
+
+	if (table->count / 64 >= table->is_dir_capacity) {
+		uint64_t const old_capacity = table->is_dir_capacity;
+		table->is_dir_capacity = table->is_dir_capacity ? table->is_dir_capacity * 2 : 1;
+
+		table->is_dir = realloc(table->is_dir, table->is_dir_capacity * sizeof *table->is_dir);
+		memset(table->is_dir + old_capacity, 0, (table->is_dir_capacity - old_capacity) * sizeof *table->is_dir);
+	}
+
+	// actually add the entry
+
+	table->totals.bytes += totals->bytes;
+	table->totals.entries += totals->entries + 1;
+
+	table->is_dir[table->count / 64] |= (uint64_t) !!node->is_dir << (table->count % 64);
+	table->count++;
+
+	uint64_t const i = table->mem_count++;
+
+	table->node_offsets[i] = offset;
+	table->sizes[i] = node->node_count;
+	table->offsets[i] = node->node_offsets_offset;
+	table->name_hashes[i] = __hash_name(name);
+	table->mtimes[i] = totals->mtime;
+	table->name_offsets[i] = table->names_bytes;
+
+	memcpy(table->names + table->mem_names_bytes, name, name_bytes);
+
+	table->names_bytes += name_bytes;
+	table->mem_names_bytes += name_bytes;
+
+	return 0;
+}
+
+static int __dir_table_write_field(iar_file_t* self, dir_table_t* table, size_t record_offset, uint64_t* mem_array) {
+	// spilled entries first (the records have all fields interleaved, so pick out the one we want)
+
+	if (table->spill) {
+		rewind(table->spill);
+
+		size_t const chunk_count = IAR_MAX_READ_BLOCK_SIZE / (sizeof(dir_table_record_t) + sizeof(uint64_t));
+
+		dir_table_record_t* const records = (void*) __io_buf(self);
+		uint64_t* const chunk = (void*) (records + chunk_count);
+
+		size_t count;
+
+		while ((count = fread(records, sizeof *records, chunk_count, table->spill)) > 0) {
+			for (size_t i = 0; i < count; i++) {
+				memcpy(&chunk[i], (uint8_t*) &records[i] + record_offset, sizeof *chunk);
+			}
+
+			if (__write(self, chunk, count * sizeof *chunk, self->current_offset) < 0) {
+				return -1;
+			}
+
+			self->current_offset += count * sizeof *chunk;
+		}
+
+		if (ferror(table->spill)) {
+			fprintf(stderr, "ERROR Failed to read back spilled directory table\n");
+			return -1;
+		}
+	}
+
+	// then whatever's left in memory
+
+	if (__write(self, mem_array, table->mem_count * sizeof *mem_array, self->current_offset) < 0) {
+		return -1;
+	}
+
+	self->current_offset += table->mem_count * sizeof *mem_array;
+
+	return 0;
+}
+
+static int __dir_table_write(iar_file_t* self, dir_table_t* table, iar_node_t* node, subtree_totals_t* totals) {
+	*totals = table->totals;
+
+	node->node_count = table->count;
+	node->node_offsets_offset = self->current_offset;
+
+	#define WRITE(buf, bytes) \
+		if (__write(self, (buf), (bytes), self->current_offset) < 0) { \
+			return -1; \
+		} \
+		\
+		self->current_offset += (bytes);
+
+	#define WRITE_FIELD(field, array) \
+		if (__dir_table_write_field(self, table, offsetof(dir_table_record_t, field), table->array) < 0) { \
+			return -1; \
+		}
+
+	WRITE_FIELD(node_offset, node_offsets)
+
+	if (self->header.version < 2) {
+		return 0;
+	}
+
+	WRITE(&table->totals.bytes, sizeof table->totals.bytes)
+	WRITE(&table->totals.entries, sizeof table->totals.entries)
+	WRITE(table->is_dir, (table->count + 63) / 64 * sizeof *table->is_dir)
+
+	WRITE_FIELD(size, sizes)
+	WRITE_FIELD(offset, offsets)
+	WRITE_FIELD(name_hash, name_hashes)
+
+	if (self->header.version >= 3) {
+		WRITE_FIELD(mtime, mtimes)
+	}
+
+	WRITE_FIELD(name_offset, name_offsets)
+
+	WRITE(&table->names_bytes, sizeof table->names_bytes) // last name offset
+
+	// names (again, spilled ones first)
+
+	if (table->spill_names) {
+		rewind(table->spill_names);
+
+		uint8_t* const block = __io_buf(self);
+		size_t bytes;
+
+		while ((bytes = fread(block, 1, IAR_MAX_READ_BLOCK_SIZE, table->spill_names)) > 0) {
+			WRITE(block, bytes)
+		}
+	}
+
+	WRITE(table->names, table->mem_names_bytes)
+
+	#undef WRITE
+	#undef WRITE_FIELD
+
+	return 0;
+}
+
+// tables are reused from one directory to the next at the same depth, so that their buffers only ever need to grow a handful of times over the whole walk
+
+static dir_table_t* __dir_table_acquire(pack_state_t* state) {
+	if (state->depth >= state->table_count) {
+		state->tables = realloc(state->tables, (state->table_count + 1) * sizeof *state->tables);
+		state->tables[state->table_count++] = calloc(1, sizeof **state->tables);
+	}
+
+	dir_table_t* const table = state->tables[state->depth++];
+
+	if (table->is_dir) {
+		memset(table->is_dir, 0, table->is_dir_capacity * sizeof *table->is_dir);
+	}
+
+	memset(&table->totals, 0, sizeof table->totals);
+
+	table->count = 0;
+	table->mem_count = 0;
+	table->names_bytes = 0;
+	table->mem_names_bytes = 0;
+
+	return table;
+}
+
+static void __dir_table_release(pack_state_t* state, dir_table_t* table) {
+	state->depth--;
+
+	if (table->spill) {
+		fclose(table->spill);
+		fclose(table->spill_names);
+
+		table->spill = NULL;
+		table->spill_names = NULL;
+	}
+}
+
+static void __pack_state_free(pack_state_t* state) {
+	for (size_t i = 0; i < state->table_count; i++) {
+		dir_table_t* const table = state->tables[i];
+
+		free(table->is_dir);
+		free(table->node_offsets);
+		free(table->sizes);
+		free(table->offsets);
+		free(table->name_hashes);
+		free(table->mtimes);
+		free(table->name_offsets);
+		free(table->names);
+
+		free(table);
+	}
+
+	free(state->tables);
+	free(state->frames);
+
+	for (size_t i = 0; i < state->layout_count; i++) {
+		free(state->layout[i].path);
+	}
+
+	free(state->layout);
+	free(state->layout_path);
+}
+
+static int __patch_append(iar_file_t* self, iar_node_t* node) {
+	if (__archive_bytes(self, &self->current_offset) < 0) {
+		return -1;
+	}
+
+	NODE_OFFSET(*node)
+
+	return 0;
+}
+
+static inline uint64_t __create_node(iar_file_t* self, iar_node_t* node, const char* name) {
+	// create node
+
+	uint64_t offset = self->current_offset;
+	self->current_offset += sizeof *node;
+
+	// write node name
+
+	node->name_bytes = strlen(name) + 1;
+	node->name_offset = self->current_offset;
+
+	if (__write(self, name, node->name_bytes, node->name_offset) < 0) {
+		return -1;
+	}
+
+	self->current_offset += node->name_bytes;
+	return offset;
+}
+
+static inline uint64_t __create_file_node(iar_file_t* self, iar_node_t* node, const char* name) {
+	// file nodes (& their names) are pushed right up against their aligned data, so that the padding ends up after the previous node's data rather than before this one's
+	// this leaves room for that data to grow in place when patching
+
+	uint64_t const meta_bytes = sizeof *node + strlen(name) + 1;
+
+	self->current_offset += meta_bytes;
+	NODE_OFFSET(*node)
+
+	self->current_offset = node->data_offset - meta_bytes;
+	node->is_dir = 0;
+
+	return __create_node(self, node, name); // this leaves 'self->current_offset' at the start of the data
+}
+
+static int __pack_stream_pipeline(iar_file_t* self, iar_node_t* node, int fd, uint64_t bytes) {
+	// read the next part of the file into one half of the pipeline while writing the previous one out from the other (see '__io_pipeline')
+	// this bypasses the write combining buffer, so flush it first (nothing is ever buffered after the data being written here)
+
+	if (__flush(self) < 0) {
+		return -1;
+	}
+
+	uint8_t* const pipeline = __io_pipeline(self);
+	uint64_t stage_bytes[2] = { 0, 0 };
+
+	uint64_t next = 0; // next offset in the file to read from
+	int half = 0;
+
+	for (;;) {
+		int const prev = !half;
+
+		iar_io_op_t ops[2];
+		size_t count = 0;
+
+		stage_bytes[half] = MIN(bytes - next, PIPELINE_BYTES);
+
+		if (stage_bytes[half]) {
+			ops[count++] = (iar_io_op_t) {
+				.fd = fd,
+				.buf = pipeline + half * PIPELINE_BYTES,
+				.bytes = stage_bytes[half],
+				.offset = next,
+			};
+		}
+
+		if (stage_bytes[prev]) {
+			ops[count++] = (iar_io_op_t) {
+				.fd = -1,
+				.write = 1,
+				.buf = pipeline + prev * PIPELINE_BYTES,
+				.bytes = stage_bytes[prev],
+				.offset = self->current_offset,
+			};
+		}
+
+		if (!count) {
+			break;
+		}
+
+		if (__io_batch(self, ops, count) < 0) {
+			return -1;
+		}
+
+		if (stage_bytes[half]) {
+			if (ops[0].rv < 0) {
+				fprintf(stderr, "ERROR Failed to read file (%s)\n", strerror(errno));
+				return -1;
+			}
+
+			// the file may have shrunk since it was stat'ed, in which case stop at its new end
+
+			if ((uint64_t) ops[0].rv < stage_bytes[half]) {
+				stage_bytes[half] = ops[0].rv;
+				bytes = next + ops[0].rv;
+			}
+
+			next += stage_bytes[half];
+		}
+
+		if (stage_bytes[prev]) {
+			iar_io_op_t* const op = &ops[count - 1];
+
+			if (op->rv != (ssize_t) op->bytes) {
+				fprintf(stderr, "ERROR Failed to write to archive (%s)\n", strerror(errno));
+				return -1;
+			}
+
+			node->data_bytes += op->bytes;
+			self->current_offset += op->bytes;
+			self->wc_high = MAX(self->wc_high, self->current_offset);
+		}
+
+		half = prev;
+	}
+
+	return 0;
+}
+
+static inline int __pack_stream_node(iar_file_t* self, iar_node_t* node, int fd, uint64_t bytes) { // if the size of the file is known, pass it as 'bytes' to save a read at EOF (otherwise, pass -1)
+	PROBE2(pack_stream_node_entry, self->current_offset, bytes);
+	node->data_bytes = 0;
+
+	uint8_t* const block = __io_buf(self);
+	ssize_t bytes_read = 0;
+
+	// if we know where the whole file is going to end up in our mapping, read it straight into there
+
+	uint8_t* const ptr = bytes != -1ull ? __map_ptr(self, self->current_offset, bytes) : NULL;
+
+	while (ptr && node->data_bytes < bytes && (bytes_read = read(fd, ptr + node->data_bytes, MIN(bytes - node->data_bytes, IAR_MMAP_FLUSH_BYTES))) > 0) {
+		STAT_ADD(self, syscalls, 1);
+		STAT_ADD(self, bytes_written, bytes_read);
+
+		node->data_bytes += bytes_read;
+		self->current_offset += bytes_read;
+
+		__map_wrote(self, self->current_offset);
+	}
+
+	// otherwise, if the backend can batch operations, pipeline reading the file & writing it out
+
+	if (!ptr && self->io->batch && bytes != -1ull && bytes > IAR_MAX_READ_BLOCK_SIZE) {
+		int const rv = __pack_stream_pipeline(self, node, fd, bytes);
+		PROBE3(pack_stream_node_return, node->data_offset, node->data_bytes, rv);
+
+		return rv;
+	}
+
+	while (node->data_bytes < bytes && (bytes_read = read(fd, block, MIN(bytes - node->data_bytes, IAR_MAX_READ_BLOCK_SIZE))) > 0) {
+		STAT_ADD(self, syscalls, 1);
+
+		if (__write(self, block, bytes_read, self->current_offset) < 0) {
+			PROBE3(pack_stream_node_return, node->data_offset, node->data_bytes, -1);
+			return -1;
+		}
+
+		node->data_bytes += bytes_read;
+		self->current_offset += bytes_read;
+	}
+
+	if (bytes_read < 0) {
+		fprintf(stderr, "ERROR Failed to read file (%s)\n", strerror(errno));
+		PROBE3(pack_stream_node_return, node->data_offset, node->data_bytes, -1);
+
+		return -1;
+	}
+
+	PROBE3(pack_stream_node_return, node->data_offset, node->data_bytes, 0);
+	return 0;
+}
+
+static inline int __pack_copy_base_node(iar_file_t* self, iar_node_t* node, iar_node_t* base_node) {
+	int const base_fd = self->base->fd;
+	node->data_bytes = base_node->data_bytes;
+
+	off_t in_offset = base_node->data_offset; // relative to the base archive, see below for 'copy_file_range' 
+	off_t out_offset = node->data_offset;
+	uint64_t left = base_node->data_bytes;
+
+	// try letting the kernel copy the data for us first (this can even reflink on filesystems which support it)
+	// it'll stop short if it's not supported for whatever reason (e.g. cross-device copy on older kernels), in which case we just fall back to copying it ourselves
+	// small files are copied through the write combining buffer like any other small write instead, as a flush & a 'copy_file_range' call for each of them would cost more than it saves
+
+#if defined(__linux__) || defined(__FreeBSD__)
+	int const copy_range = left >= IAR_COPY_RANGE_MIN_BYTES && base_fd >= 0 && self->fd >= 0;
+
+	// this bypasses the write combining buffer, so flush it first
+	// (data is never buffered after what's being copied here, but make sure the gap up until here doesn't get zero-filled later on)
+
+	if (copy_range && __flush(self) < 0) {
+		return -1;
+	}
+
+	in_offset += self->base->base_offset;
+
+	while (copy_range && left > 0) {
+		ssize_t bytes_copied = copy_file_range(base_fd, &in_offset, self->fd, &out_offset, left, 0);
+		STAT_ADD(self, syscalls, 1);
+
+		if (bytes_copied <= 0) {
+			break;
+		}
+
+		STAT_ADD(self, bytes_written, bytes_copied);
+
+		left -= bytes_copied;
+	}
+
+	in_offset -= self->base->base_offset;
+
+	if (copy_range) {
+		self->wc_high = MAX(self->wc_high, (uint64_t) out_offset);
+	}
+#else
+	(void) base_fd;
+#endif
+
+	if (left > 0) {
+		uint8_t* const block = __io_buf(self);
+
+		while (left > 0) {
+			// if the base is mapped, there's no need to read it into our buffer first
+
+			uint64_t const bytes = MIN(left, IAR_MAX_READ_BLOCK_SIZE);
+			const uint8_t* const peeked = __peek(self->base, in_offset, bytes);
+
+			if (peeked) {
+				if (__write(self, peeked, bytes, out_offset) < 0) {
+					return -1;
+				}
+
+				in_offset += bytes;
+				out_offset += bytes;
+				left -= bytes;
+
+				continue;
+			}
+
+			ssize_t bytes_read = __read(self->base, block, bytes, in_offset);
+
+			if (bytes_read <= 0) {
+				fprintf(stderr, "ERROR Failed to read node data from base archive\n");
+				return -1;
+			}
+
+			if (__write(self, block, bytes_read, out_offset) < 0) {
+				return -1;
+			}
+
+			in_offset += bytes_read;
+			out_offset += bytes_read;
+			left -= bytes_read;
+		}
+	}
+
+	self->current_offset += node->data_bytes;
+	return 0;
+}
+
+static inline uint64_t __mtime_ns(struct stat* sb) {
+#if defined(__APPLE__)
+	return sb->st_mtimespec.tv_sec * 1000000000ull + sb->st_mtimespec.tv_nsec;
+#else
+	return sb->st_mtim.tv_sec * 1000000000ull + sb->st_mtim.tv_nsec;
+#endif
+}
+
+static int __scan_entry_cmp(const void* _a, const void* _b) {
+	const scan_entry_t* a = _a;
+	const scan_entry_t* b = _b;
+
+	return strcmp(a->name, b->name);
+}
+
+static int __scan_run_read(scan_run_t* run) {
+	// spilled entries are each the entry itself (whose name & directory pointers are meaningless), followed by the size of its name & the name
+
+	uint64_t name_bytes;
+
+	if (fread(&run->entry, sizeof run->entry, 1, run->file) != 1) {
+		run->done = 1;
+		return ferror(run->file) ? -1 : 0;
+	}
+
+	if (fread(&name_bytes, sizeof name_bytes, 1, run->file) != 1) {
+		return -1;
+	}
+
+	if (name_bytes > run->name_capacity) {
+		run->name_capacity = name_bytes * 2;
+		run->name = realloc(run->name, run->name_capacity);
+	}
+
+	if (fread(run->name, 1, name_bytes, run->file) != name_bytes) {
+		return -1;
+	}
+
+	run->entry.name = run->name;
+	return 0;
+}
+
+static int __scan_spill(scan_dir_t* dir) {
+	// sort what's in memory & write it out as a new run
+
+	for (size_t i = 0; i < dir->entry_count; i++) {
+		dir->entries[i].name = dir->names + (uintptr_t) dir->entries[i].name;
+	}
+
+	qsort(dir->entries, dir->entry_count, sizeof *dir->entries, __scan_entry_cmp);
+
+	if (!dir->spill) {
+		dir->spill = calloc(1, sizeof *dir->spill);
+	}
+
+	scan_spill_t* const spill = dir->spill;
+
+	spill->runs = realloc(spill->runs, (spill->run_count + 1) * sizeof *spill->runs);
+	scan_run_t* const run = &spill->runs[spill->run_count++];
+
+	memset(run, 0, sizeof *run);
+	run->file = tmpfile();
+
+	if (!run->file) {
+		fprintf(stderr, "ERROR Failed to create temporary file for directory entries (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	for (size_t i = 0; i < dir->entry_count; i++) {
+		scan_entry_t* const entry = &dir->entries[i];
+		uint64_t const name_bytes = strlen(entry->name) + 1;
+
+		if (
+			fwrite(entry, sizeof *entry, 1, run->file) != 1 ||
+			fwrite(&name_bytes, sizeof name_bytes, 1, run->file) != 1 ||
+			fwrite(entry->name, 1, name_bytes, run->file) != name_bytes
+		) {
+			fprintf(stderr, "ERROR Failed to spill directory entries to temporary file (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	dir->entry_count = 0;
+
+	// read back the first entry of the run, so that it's ready to be merged
+
+	rewind(run->file);
+
+	if (__scan_run_read(run) < 0) {
+		fprintf(stderr, "ERROR Failed to read back spilled directory entries\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int scan_dir(DIR* dp, scan_dir_t* dir, int with_stat) {
+	size_t entries_capacity = 0;
+	size_t names_bytes = 0;
+	size_t names_capacity = 0;
+	size_t total = 0; // including spilled entries
+
+	dir->entries = NULL;
+	dir->entry_count = 0;
+	dir->names = NULL;
+	dir->spill = NULL;
+
+	// names are all packed together, so while scanning, 'name' is actually an offset into 'names' (which may still move around)
+
+	struct dirent* entry;
+
+	while ((entry = readdir(dp)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		// we can only trust 'd_type' if it's definitely a directory or a regular file (symlinks are followed, like everything else)
+
+		int is_dir = entry->d_type == DT_DIR;
+		int has_stat = 0;
+		struct stat sb;
+
+		if (with_stat || (entry->d_type != DT_DIR && entry->d_type != DT_REG)) {
+			has_stat = fstatat(dirfd(dp), entry->d_name, &sb, 0) == 0;
+
+			if (has_stat) {
+				is_dir = S_ISDIR(sb.st_mode);
+			}
+		}
+
+		size_t const name_bytes = strlen(entry->d_name) + 1;
+
+		// if we'd have to grow past our memory budget, spill everything we've got in memory instead (see 'scan_spill_t')
+
+		size_t const next_entries_capacity = dir->entry_count >= entries_capacity ? entries_capacity * 2 : entries_capacity;
+		size_t const next_names_capacity = names_bytes + name_bytes > names_capacity ? MAX(names_capacity * 2, names_bytes + name_bytes) : names_capacity;
+
+		if (
+			!with_stat && dir->entry_count &&
+			next_entries_capacity * sizeof *dir->entries + next_names_capacity > IAR_DIR_TABLE_MAX_MEMORY
+		) {
+			if (__scan_spill(dir) < 0) {
+				return -1;
+			}
+
+			names_bytes = 0;
+		}
+
+		if (dir->entry_count >= entries_capacity) {
+			entries_capacity = entries_capacity ? entries_capacity * 2 : 16;
+			dir->entries = realloc(dir->entries, entries_capacity * sizeof *dir->entries);
+		}
+
+		if (names_bytes + name_bytes > names_capacity) {
+			names_capacity = MAX(names_capacity * 2, names_bytes + name_bytes);
+			dir->names = realloc(dir->names, names_capacity);
+		}
+
+		scan_entry_t* const scan_entry = &dir->entries[dir->entry_count++];
+
+		scan_entry->name = (char*) (uintptr_t) names_bytes;
+		scan_entry->is_dir = is_dir;
+		scan_entry->dir = NULL;
+
+		scan_entry->has_stat = has_stat;
+
+		if (has_stat) {
+			scan_entry->size = sb.st_size;
+			scan_entry->dev = sb.st_dev;
+			scan_entry->ino = sb.st_ino;
+			scan_entry->mtime = __mtime_ns(&sb);
+		}
+
+		memcpy(dir->names + names_bytes, entry->d_name, name_bytes);
+		names_bytes += name_bytes;
+
+		total++;
+	}
+
+	// if anything was spilled, spill the rest too, as everything's going to be taken from the runs from now on
+
+	if (dir->spill) {
+		if (dir->entry_count && __scan_spill(dir) < 0) {
+			return -1;
+		}
+
+		free(dir->entries);
+		free(dir->names);
+
+		dir->entries = NULL;
+		dir->names = NULL;
+		dir->entry_count = total;
+
+		return 0;
+	}
+
+	for (size_t i = 0; i < dir->entry_count; i++) {
+		dir->entries[i].name = dir->names + (uintptr_t) dir->entries[i].name;
+	}
+
+	if (dir->entry_count) {
+		qsort(dir->entries, dir->entry_count, sizeof *dir->entries, __scan_entry_cmp);
+	}
+	return 0;
+}
+
+static scan_entry_t* scan_dir_next(scan_dir_t* dir, size_t* index) {
+	if (*index >= dir->entry_count) {
+		return NULL;
+	}
+
+	scan_spill_t* const spill = dir->spill;
+
+	if (!spill) {
+		return &dir->entries[(*index)++];
+	}
+
+	// take the smallest of the next entries of all the runs
+	// (its name buffer is swapped with ours rather than copied, so that our entry's name stays valid)
+
+	scan_run_t* min = NULL;
+
+	for (size_t i = 0; i < spill->run_count; i++) {
+		scan_run_t* const run = &spill->runs[i];
+
+		if (!run->done && (!min || strcmp(run->entry.name, min->entry.name) < 0)) {
+			min = run;
+		}
+	}
+
+	if (!min) {
+		fprintf(stderr, "ERROR Spilled directory entries are missing\n");
+		return NULL;
+	}
+
+	spill->entry = min->entry;
+
+	char* const name = spill->name;
+	size_t const name_capacity = spill->name_capacity;
+
+	spill->name = min->name;
+	spill->name_capacity = min->name_capacity;
+
+	min->name = name;
+	min->name_capacity = name_capacity;
+
+	if (__scan_run_read(min) < 0) {
+		fprintf(stderr, "ERROR Failed to read back spilled directory entries\n");
+		return NULL;
+	}
+
+	(*index)++;
+	return &spill->entry;
+}
+
+static void scan_dir_free(scan_dir_t* dir) {
+	for (size_t i = 0; dir->entries && i < dir->entry_count; i++) {
+		if (dir->entries[i].dir) {
+			scan_dir_free(dir->entries[i].dir);
+			free(dir->entries[i].dir);
+		}
+	}
+
+	free(dir->entries);
+	free(dir->names);
+
+	if (!dir->spill) {
+		return;
+	}
+
+	for (size_t i = 0; i < dir->spill->run_count; i++) {
+		if (dir->spill->runs[i].file) {
+			fclose(dir->spill->runs[i].file);
+		}
+
+		free(dir->spill->runs[i].name);
+	}
+
+	free(dir->spill->runs);
+	free(dir->spill->name);
+	free(dir->spill);
+}
+
+// parallel scanning
+// directories still to be scanned are put in a queue, which a fixed number of threads take from until there's nothing left to scan
+// directories are opened relative to their parent, which is kept open until all its subdirectories have been opened (full paths could be longer than 'PATH_MAX')
+// only up to 'IAR_MAX_OPEN_DIRS' directories are kept open like this; past that, they're opened one component at a time from their nearest open ancestor
+
+typedef struct scan_path_s {
+	struct scan_path_s* parent;
+	char* name; // relative to the parent
+
+	DIR* dp; // NULL if not (or no longer) kept open
+	size_t refs; // the job scanning it & its subdirectories still around
+} scan_path_t;
+
+typedef struct scan_job_s {
+	struct scan_job_s* next;
+
+	scan_dir_t* dir;
+	scan_path_t* path;
+} scan_job_t;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	scan_job_t* queue;
+	size_t pending; // jobs queued or being worked on
+	size_t open_dirs; // directories kept open for their subdirectories
+	int error;
+} scan_pool_t;
+
+static void __scan_push(scan_pool_t* pool, scan_dir_t* dir, scan_path_t* parent, const char* name) { // must be called with the mutex held
+	scan_path_t* const path = calloc(1, sizeof *path);
+
+	path->parent = parent;
+	path->name = strdup(name);
+	path->refs = 1;
+
+	parent->refs++;
+
+	scan_job_t* const job = malloc(sizeof *job);
+
+	job->dir = dir;
+	job->path = path;
+
+	job->next = pool->queue;
+	pool->queue = job;
+	pool->pending++;
+
+	pthread_cond_signal(&pool->cond);
+}
+
+static void __scan_release(scan_pool_t* pool, scan_path_t* path) { // must be called with the mutex held
+	while (path && !--path->refs) {
+		scan_path_t* const parent = path->parent;
+
+		if (path->dp) {
+			closedir(path->dp);
+			pool->open_dirs--;
+		}
+
+		free(path->name);
+		free(path);
+
+		path = parent;
+	}
+}
+
+static DIR* __scan_open(scan_path_t* path, scan_path_t* from) { // open 'path' relative to its ancestor 'from', which must be kept open
+	size_t depth = 0;
+
+	for (scan_path_t* ancestor = path; ancestor != from; ancestor = ancestor->parent) {
+		depth++;
+	}
+
+	scan_path_t** const chain = malloc(depth * sizeof *chain);
+	size_t i = depth;
+
+	for (scan_path_t* ancestor = path; ancestor != from; ancestor = ancestor->parent) {
+		chain[--i] = ancestor;
+	}
+
+	int fd = -1;
+
+	for (; i < depth; i++) {
+		int const next_fd = openat(fd < 0 ? dirfd(from->dp) : fd, chain[i]->name, O_RDONLY | O_DIRECTORY);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		if ((fd = next_fd) < 0) {
+			fprintf(stderr, "ERROR Failed to open directory '%s' (%s)\n", chain[i]->name, strerror(errno));
+			break;
+		}
+	}
+
+	free(chain);
+
+	DIR* const dp = fd < 0 ? NULL : fdopendir(fd);
+
+	if (fd >= 0 && !dp) {
+		fprintf(stderr, "ERROR Failed to open directory '%s' (%s)\n", path->name, strerror(errno));
+		close(fd);
+	}
+
+	return dp;
+}
+
+static void* __scan_worker(void* _pool) {
+	scan_pool_t* const pool = _pool;
+	pthread_mutex_lock(&pool->mutex);
+
+	for (;;) {
+		while (!pool->queue && pool->pending && !pool->error) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+
+		if (!pool->queue || pool->error) { // nothing left to do (or something went wrong somewhere)
+			break;
+		}
+
+		scan_job_t* const job = pool->queue;
+		pool->queue = job->next;
+
+		// hold on to the nearest ancestor which is open (the root always is), so that it stays that way while we open from it
+
+		scan_path_t* from = job->path->parent;
+
+		while (!from->dp) {
+			from = from->parent;
+		}
+
+		from->refs++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		// actually scan the directory
+
+		DIR* const dp = __scan_open(job->path, from);
+		int const error = !dp;
+
+		if (dp) {
+			scan_dir(dp, job->dir, 1);
+		}
+
+		// queue up all its subdirectories, & keep it open for them if there's still room
+
+		pthread_mutex_lock(&pool->mutex);
+		__scan_release(pool, from);
+
+		int has_subdirs = 0;
+
+		for (size_t i = 0; !error && i < job->dir->entry_count; i++) {
+			scan_entry_t* const entry = &job->dir->entries[i];
+
+			if (!entry->is_dir) {
+				continue;
+			}
+
+			entry->dir = calloc(1, sizeof *entry->dir);
+			__scan_push(pool, entry->dir, job->path, entry->name);
+
+			has_subdirs = 1;
+		}
+
+		if (dp && has_subdirs && pool->open_dirs < IAR_MAX_OPEN_DIRS) {
+			job->path->dp = dp;
+			pool->open_dirs++;
+		}
+
+		else if (dp) {
+			closedir(dp);
+		}
+
+		__scan_release(pool, job->path);
+		pool->error |= error;
+
+		if (!--pool->pending || error) {
+			pthread_cond_broadcast(&pool->cond);
+		}
+
+		free(job);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+static int scan_tree(iar_file_t* self, const char* path, scan_dir_t* root) { // return 1 if the root is a directory & was scanned, 0 if it's not a directory, -1 if failure
+	int const root_fd = open(path, O_RDONLY);
+
+	if (root_fd < 0) {
+		fprintf(stderr, "ERROR Failed to open '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat sb;
+	DIR* const root_dp = fstat(root_fd, &sb) < 0 || !S_ISDIR(sb.st_mode) ? NULL : fdopendir(root_fd);
+
+	if (!root_dp) {
+		close(root_fd);
+		return 0;
+	}
+
+	scan_pool_t pool = {
+		.open_dirs = 1,
+	};
+
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	// the root is what everything is opened relative to in the end, so it's only closed once we're done with it
+
+	scan_path_t* const root_path = calloc(1, sizeof *root_path);
+
+	root_path->dp = root_dp;
+	root_path->refs = 1;
+
+	__scan_push(&pool, root, root_path, ".");
+
+	pthread_t* const threads = malloc(self->scan_threads * sizeof *threads);
+	uint64_t thread_count = 0;
+
+	for (; thread_count < self->scan_threads; thread_count++) {
+		if (pthread_create(&threads[thread_count], NULL, __scan_worker, &pool)) {
+			break;
+		}
+	}
+
+	if (!thread_count) { // couldn't create any threads, so just do it ourselves
+		__scan_worker(&pool);
+	}
+
+	for (uint64_t i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// if something went wrong, there may be jobs left over in the queue
+
+	while (pool.queue) {
+		scan_job_t* const job = pool.queue;
+		pool.queue = job->next;
+
+		__scan_release(&pool, job->path);
+		free(job);
+	}
+
+	__scan_release(&pool, root_path);
+	free(threads);
+
+	pthread_mutex_destroy(&pool.mutex);
+	pthread_cond_destroy(&pool.cond);
+
+	return pool.error ? -1 : 1;
+}
+
+// layout planning
+// when the whole tree has been scanned beforehand (sizes & all), we know exactly where everything is going to end up, so we can allocate the whole archive on disk before writing anything to it
+// this mirrors exactly what 'pack_walk' does, only without writing anything
+// contiguous stretches of the archive are allocated together; only gaps of padding which span whole filesystem blocks are left as holes (with the default alignment, that means everything is allocated in one go)
+
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+} plan_extent_t;
+
+typedef struct {
+	scan_dir_t* dir;
+	size_t index;
+
+	uint64_t count;
+	uint64_t names_bytes;
+} plan_frame_t;
+
+static void __plan_allocate(iar_file_t* self, plan_extent_t* extent, int* alloc_errno) { // '*alloc_errno' is set to 'errno' of the first allocation which failed
+	if (extent->end <= extent->start || self->fd < 0 || *alloc_errno) {
+		return;
+	}
+
+	int rv = 0;
+
+#if defined(__linux__)
+	if (fallocate(self->fd, FALLOC_FL_KEEP_SIZE, extent->start, extent->end - extent->start) < 0) {
+		rv = errno;
+	}
+#elif !defined(__APPLE__)
+	// there's no way to allocate without changing the size here, so only do so when the archive is about to be resized to be mapped anyway
+
+	if (self->mmap_write) {
+		rv = posix_fallocate(self->fd, extent->start, extent->end - extent->start);
+	}
+#else
+	rv = self->mmap_write ? EOPNOTSUPP : 0;
+#endif
+
+	*alloc_errno = rv;
+}
+
+static void __plan_extent(iar_file_t* self, plan_extent_t* extent, uint64_t start, uint64_t end, int* alloc_errno) {
+	if (start >= end) {
+		return;
+	}
+
+	if (__spans_block(extent->end, start)) {
+		__plan_allocate(self, extent, alloc_errno);
+		extent->start = start;
+	}
+
+	extent->end = end;
+}
+
+static uint64_t pack_plan(iar_file_t* self, scan_dir_t* root, const char* name, int* alloc_errno) { // '*alloc_errno' is set if the archive couldn't all be allocated on disk
+	uint64_t offset = sizeof(self->header);
+	uint64_t const node_bytes = sizeof(iar_node_t);
+
+	plan_extent_t extent = {
+		.start = offset,
+		.end = offset,
+	};
+
+	plan_frame_t* frames = malloc(16 * sizeof *frames);
+	size_t frame_count = 1;
+	size_t frames_capacity = 16;
+
+	frames[0] = (plan_frame_t) { .dir = root };
+
+	*alloc_errno = 0;
+	__plan_extent(self, &extent, offset, offset + node_bytes + strlen(name) + 1, alloc_errno);
+	offset = extent.end;
+
+	while (frame_count) {
+		plan_frame_t* const frame = &frames[frame_count - 1];
+
+		if (frame->index < frame->dir->entry_count) {
+			scan_entry_t* const entry = &frame->dir->entries[frame->index++];
+			uint64_t const meta_bytes = node_bytes + strlen(entry->name) + 1;
+
+			if (!entry->has_stat || (!entry->is_dir && entry->dev == self->dev && entry->ino == self->ino)) {
+				continue; // will fail or be ignored when packing
+			}
+
+			frame->count++;
+			frame->names_bytes += strlen(entry->name) + 1;
+
+			if (!entry->is_dir) { // see '__create_file_node'
+				uint64_t const data_offset = ((offset + meta_bytes) & ~(self->header.page_bytes - 1)) + self->header.page_bytes;
+
+				__plan_extent(self, &extent, data_offset - meta_bytes, data_offset + entry->size, alloc_errno);
+				offset = data_offset + entry->size;
+
+				continue;
+			}
+
+			__plan_extent(self, &extent, offset, offset + meta_bytes, alloc_errno);
+			offset += meta_bytes;
+
+			if (frame_count >= frames_capacity) {
+				frames_capacity *= 2;
+				frames = realloc(frames, frames_capacity * sizeof *frames);
+			}
+
+			frames[frame_count++] = (plan_frame_t) { .dir = entry->dir };
+			continue;
+		}
+
+		// directory table (see '__dir_table_write')
+
+		uint64_t table_bytes = frame->count * sizeof(uint64_t);
+
+		if (self->header.version >= 2) {
+			table_bytes += __dir_table_words(frame->count, self->header.version) * sizeof(uint64_t) + frame->names_bytes;
+		}
+
+		__plan_extent(self, &extent, offset, offset + table_bytes, alloc_errno);
+		offset += table_bytes;
+
+		frame_count--;
+	}
+
+	__plan_allocate(self, &extent, alloc_errno);
+	free(frames);
+
+	return offset;
+}
+
+// once we know how big the archive is going to be, we can map the whole thing & write straight into it
+
+static int pack_map(iar_file_t* self, uint64_t bytes) {
+	if (ftruncate(self->fd, bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to resize archive for mapping (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	self->map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+
+	if (self->map == MAP_FAILED) {
+		fprintf(stderr, "ERROR Failed to map archive (%s)\n", strerror(errno));
+		self->map = NULL;
+
+		return -1;
+	}
+
+	self->map_bytes = bytes;
+	self->map_flushed = 0;
+
+	return 0;
+}
+
+static int pack_unmap(iar_file_t* self) {
+	if (!self->map) {
+		return 0;
+	}
+
+	int rv = 0;
+
+	if (munmap(self->map, self->map_bytes) < 0) {
+		fprintf(stderr, "ERROR Failed to unmap archive (%s)\n", strerror(errno));
+		rv = -1;
+	}
+
+	self->map = NULL;
+	return rv;
+}
+
+// keep the number of open directories within 'IAR_MAX_OPEN_DIRS' by closing the shallowest ones first (except for 'keep')
+
+static void __pack_evict_dirs(pack_state_t* state, size_t keep) {
+	for (size_t i = 0; state->open_dirs > IAR_MAX_OPEN_DIRS && i < state->frame_count; i++) {
+		pack_frame_t* const frame = &state->frames[i];
+
+		if (i == keep || !frame->dp) {
+			continue;
+		}
+
+		closedir(frame->dp);
+		frame->dp = NULL;
+
+		state->open_dirs--;
+	}
+}
+
+static int __pack_frame_fd(pack_state_t* state, size_t bottom, size_t i) {
+	if (state->frames[i].dp) {
+		return dirfd(state->frames[i].dp);
+	}
+
+	// find the nearest ancestor which is still open & reopen everything from there on down
+
+	size_t first = i;
+
+	while (first > bottom && !state->frames[first - 1].dp) {
+		first--;
+	}
+
+	for (size_t j = first; j <= i; j++) {
+		pack_frame_t* const frame = &state->frames[j];
+
+		int const parent_fd = j == bottom ? frame->root_fd : dirfd(state->frames[j - 1].dp);
+		int const fd = openat(parent_fd, frame->path, O_RDONLY | O_DIRECTORY);
+
+		if (fd < 0 || !(frame->dp = fdopendir(fd))) {
+			fprintf(stderr, "ERROR Failed to reopen directory '%s' (%s)\n", frame->path, strerror(errno));
+
+			if (fd >= 0) {
+				close(fd);
+			}
+
+			return -1;
+		}
+
+		state->open_dirs++;
+		__pack_evict_dirs(state, j);
+	}
+
+	return dirfd(state->frames[i].dp);
+}
+
+static void __pack_pop(pack_state_t* state) {
+	pack_frame_t* const frame = &state->frames[--state->frame_count];
+
+	__dir_table_release(state, frame->table);
+	scan_dir_free(&frame->local_scan);
+
+	if (frame->has_base) {
+		iar_closedir(&frame->base_dir);
+	}
+
+	if (frame->dp) {
+		closedir(frame->dp); // this also closes its fd
+		state->open_dirs--;
+	}
+}
+
+// pack a single node
+// files are packed entirely, whereas directories only have their node created & a frame pushed for their entries to be packed later on
+
+static uint64_t __pack_node(iar_file_t* self, pack_state_t* state, iar_node_t* node, subtree_totals_t* totals, int dir_fd, const char* path, const char* name, const scan_entry_t* entry, iar_node_t* base_node, uint64_t base_mtime) { // return offset, -1 if failure, -2 if file to be ignored
+	int is_dir = entry->is_dir;
+	scan_dir_t* const scan = entry->dir;
+
+	// if it was already stat'ed when scanning, we can skip that, and even skip opening it if it's our output
+
+	struct stat sb;
+	uint64_t mtime = entry->mtime;
+
+	if (entry->has_stat) {
+		sb.st_size = entry->size;
+
+		if (!is_dir && entry->dev == self->dev && entry->ino == self->ino) {
+			return -2;
+		}
+	}
+
+	// if there's a file to reuse in the base archive, stat it without opening it first, as it doesn't need opening at all if it's unchanged
+
+	int const has_base_file = !is_dir && base_node && !base_node->is_dir;
+
+	if (has_base_file && !entry->has_stat) {
+		if (fstatat(dir_fd, path, &sb, 0) < 0) {
+			fprintf(stderr, "ERROR Failed to stat '%s' (%s)\n", path, strerror(errno));
+			return -1;
+		}
+
+		is_dir = S_ISDIR(sb.st_mode);
+		mtime = __mtime_ns(&sb);
+
+		// make sure the file to be read is not our output (this can create infinite loops)
+
+		if (!is_dir && sb.st_dev == (dev_t) self->dev && sb.st_ino == (ino_t) self->ino) {
+			return -2;
+		}
+	}
+
+	// if the file is unchanged since it was packed into the base archive, its data is copied straight from there instead of rereading it
+	// (i.e. it still has the size & mtime recorded for it there; archives before version 3 don't record mtimes, so nothing is reused from them)
+
+	int const reuse =
+		has_base_file && !is_dir &&
+		(uint64_t) sb.st_size == base_node->data_bytes &&
+		base_mtime && mtime == base_mtime;
+
+	// everything is opened relative to the parent directory, so that the kernel doesn't have to resolve the whole path each time
+	// if we already know this is a directory (from 'd_type'), we can skip stat'ing it entirely
+
+	int const fd = reuse ? -1 : openat(dir_fd, path, O_RDONLY | (is_dir ? O_DIRECTORY : 0));
+
+	if (!reuse && fd < 0) {
+		fprintf(stderr, "ERROR Failed to open '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!is_dir && !entry->has_stat && !has_base_file) {
+		if (fstat(fd, &sb) < 0) {
+			fprintf(stderr, "ERROR Failed to stat '%s' (%s)\n", path, strerror(errno));
+			close(fd);
+
+			return -1;
+		}
+
+		is_dir = S_ISDIR(sb.st_mode);
+		mtime = __mtime_ns(&sb);
+
+		// make sure the file to be read is not our output (this can create infinite loops)
+
+		if (!is_dir && sb.st_dev == (dev_t) self->dev && sb.st_ino == (ino_t) self->ino) {
+			close(fd);
+			return -2;
+		}
+	}
+
+	// btw, the order of what comes where is not specified by the standard
+	// so long as all offsets point to the right place, you've got nothing to worry about
+	// so if you want, you can put the node data after the name (weirdo), whatever you want
+
+	uint64_t offset;
+
+	if (!is_dir) { // handle files
+		offset = __create_file_node(self, node, name);
+
+		if (offset == -1ull) {
+			if (fd >= 0) {
+				close(fd);
+			}
+
+			return -1;
+		}
+
+		int const rv = reuse ?
+			__pack_copy_base_node(self, node, base_node) :
+			__pack_stream_node(self, node, fd, sb.st_size);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		if (rv < 0) {
+			return -1;
+		}
+
+		totals->bytes = node->data_bytes;
+		totals->entries = 0;
+		totals->mtime = mtime;
+
+		if (__write(self, node, sizeof *node, offset) < 0) {
+			return -1;
+		}
+
+		return offset;
+	}
+
+	// handle directories
+
+	DIR* dp = fdopendir(fd);
+
+	if (!dp) {
+		fprintf(stderr, "ERROR Failed to open directory '%s' (%s)\n", path, strerror(errno));
+		close(fd);
+
+		return -1;
+	}
+
+	// if this directory hasn't been scanned beforehand, scan it now
+
+	scan_dir_t local_scan = { 0 };
+
+	if (!scan && scan_dir(dp, &local_scan, 0) < 0) {
+		scan_dir_free(&local_scan);
+		closedir(dp);
+
+		return -1;
+	}
+
+	offset = __create_node(self, node, name);
+	node->is_dir = 1;
+
+	if (offset == -1ull) {
+		scan_dir_free(&local_scan);
+		closedir(dp);
+
+		return -1;
+	}
+
+	if (state->frame_count >= state->frames_capacity) {
+		state->frames_capacity = state->frames_capacity ? state->frames_capacity * 2 : 16;
+		state->frames = realloc(state->frames, state->frames_capacity * sizeof *state->frames);
+	}
+
+	pack_frame_t* const frame = &state->frames[state->frame_count++];
+	memset(frame, 0, sizeof *frame);
+
+	frame->dp = dp;
+	frame->path = path;
+	frame->name = name;
+	frame->root_fd = dir_fd;
+
+	frame->offset = offset;
+	frame->node = *node;
+
+	if (base_node && base_node->is_dir && iar_opendir(self->base, &frame->base_dir, base_node) == 0) {
+		frame->has_base = 1;
+	}
+
+	frame->scan = scan;
+	frame->local_scan = local_scan;
+
+	frame->table = __dir_table_acquire(state);
+
+	state->open_dirs++;
+	__pack_evict_dirs(state, state->frame_count - 1);
+
+	return offset;
+}
+
+// profile-guided layout
+// an access trace (see 'self->trace') lists the files an application found, read & mapped, in order
+// those files are packed before anything else, in the order they were first read or mapped in (and then in the order they were found in, for those which never were), so that they're all contiguous & read sequentially on a cold start
+// the walk then just adds them to their directories' tables, where it would otherwise have packed them
+
+typedef struct {
+	uint64_t data_offset;
+	size_t index; // of the path in 'layout'
+} layout_find_t;
+
+static int __layout_find_cmp(const void* _a, const void* _b) {
+	const layout_find_t* a = _a;
+	const layout_find_t* b = _b;
+
+	if (a->data_offset != b->data_offset) {
+		return (a->data_offset > b->data_offset) - (a->data_offset < b->data_offset);
+	}
+
+	return (a->index > b->index) - (a->index < b->index); // keep the first one found
+}
+
+static int __layout_path_cmp(const void* _a, const void* _b) {
+	const pack_layout_t* a = _a;
+	const pack_layout_t* b = _b;
+
+	int const cmp = strcmp(a->path, b->path);
+
+	if (cmp) {
+		return cmp;
+	}
+
+	return (a->rank > b->rank) - (a->rank < b->rank);
+}
+
+static int __layout_rank_cmp(const void* _a, const void* _b) {
+	const pack_layout_t* a = _a;
+	const pack_layout_t* b = _b;
+
+	return (a->rank > b->rank) - (a->rank < b->rank);
+}
+
+static int __layout_lookup_cmp(const void* _a, const void* _b) { // paths are unique by the time anything is looked up
+	const pack_layout_t* a = _a;
+	const pack_layout_t* b = _b;
+
+	return strcmp(a->path, b->path);
+}
+
+static char* __layout_normalize(const char* path) { // get rid of leading, trailing & repeated slashes, so that paths can be compared as they are built by the walk
+	char* const normalized = malloc(strlen(path) + 1);
+	char* out = normalized;
+
+	for (; *path; path++) {
+		if (*path == '/' && (out == normalized || out[-1] == '/')) {
+			continue;
+		}
+
+		*out++ = *path;
+	}
+
+	if (out > normalized && out[-1] == '/') {
+		out--;
+	}
+
+	*out = '\0';
+	return normalized;
+}
+
+static int __layout_reachable(const char* path) { // whether the walk could ever get to a (normalized) path, i.e. it has no '.' or '..' components (it could otherwise point outside the tree, & would never be looked up in any case)
+	while (*path) {
+		size_t const bytes = strcspn(path, "/");
+
+		if ((bytes == 1 && path[0] == '.') || (bytes == 2 && path[0] == '.' && path[1] == '.')) {
+			return 0;
+		}
+
+		path += bytes + !!path[bytes];
+	}
+
+	return 1;
+}
+
+static void __layout_parse(iar_file_t* self, pack_state_t* state) {
+	// first collect all the files found (which have their paths) & all the offsets read or mapped
+
+	pack_layout_t* finds = NULL;
+	size_t find_count = 0;
+	size_t finds_capacity = 0;
+
+	uint64_t* accesses = NULL;
+	size_t access_count = 0;
+	size_t accesses_capacity = 0;
+
+	char* line = NULL;
+	size_t line_capacity = 0;
+
+	while (getline(&line, &line_capacity, self->layout) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+
+		char* save_ptr;
+		char* const event = strtok_r(line, "\t", &save_ptr);
+		char* const offset = strtok_r(NULL, "\t", &save_ptr);
+		char* const path = strtok_r(NULL, "", &save_ptr);
+
+		if (!event || !offset) {
+			continue;
+		}
+
+		uint64_t const data_offset = strtoull(offset, NULL, 10);
+
+		if (strcmp(event, "find") == 0 && path) {
+			if (find_count >= finds_capacity) {
+				finds_capacity = finds_capacity ? finds_capacity * 2 : 64;
+				finds = realloc(finds, finds_capacity * sizeof *finds);
+			}
+
+			finds[find_count++] = (pack_layout_t) {
+				.path = __layout_normalize(path),
+				.offset = data_offset,
+			};
+		}
+
+		else if (strcmp(event, "read") == 0 || strcmp(event, "map") == 0) {
+			if (access_count >= accesses_capacity) {
+				accesses_capacity = accesses_capacity ? accesses_capacity * 2 : 64;
+				accesses = realloc(accesses, accesses_capacity * sizeof *accesses);
+			}
+
+			accesses[access_count++] = data_offset;
+		}
+	}
+
+	free(line);
+
+	// rank files by when they were first read or mapped, which means finding their paths by data offset (in the archive the trace was taken from)
+	// files which were never read or mapped come after, in the order they were found in
+
+	layout_find_t* const by_offset = malloc(find_count * sizeof *by_offset);
+
+	for (size_t i = 0; i < find_count; i++) {
+		by_offset[i].data_offset = finds[i].offset;
+		by_offset[i].index = i;
+		finds[i].rank = -1;
+	}
+
+	qsort(by_offset, find_count, sizeof *by_offset, __layout_find_cmp);
+
+	size_t rank = 0;
+
+	for (size_t i = 0; i < access_count; i++) {
+		layout_find_t const key = { .data_offset = accesses[i] };
+		size_t lo = 0, hi = find_count;
+
+		while (lo < hi) { // first find with this data offset
+			size_t const mid = (lo + hi) / 2;
+
+			if (by_offset[mid].data_offset < key.data_offset) {
+				lo = mid + 1;
+			}
+
+			else {
+				hi = mid;
+			}
+		}
+
+		if (lo < find_count && by_offset[lo].data_offset == key.data_offset && finds[by_offset[lo].index].rank == (size_t) -1) {
+			finds[by_offset[lo].index].rank = rank++;
+		}
+	}
+
+	for (size_t i = 0; i < find_count; i++) {
+		if (finds[i].rank == (size_t) -1) {
+			finds[i].rank = rank + i;
+		}
+	}
+
+	free(by_offset);
+	free(accesses);
+
+	// only keep the first access of each path
+
+	qsort(finds, find_count, sizeof *finds, __layout_path_cmp);
+	size_t unique_count = 0;
+
+	for (size_t i = 0; i < find_count; i++) {
+		if (unique_count && strcmp(finds[unique_count - 1].path, finds[i].path) == 0) {
+			free(finds[i].path);
+			continue;
+		}
+
+		finds[unique_count++] = finds[i];
+	}
+
+	qsort(finds, unique_count, sizeof *finds, __layout_rank_cmp);
+
+	state->layout = finds;
+	state->layout_count = unique_count;
+}
+
+static int __layout_pack(iar_file_t* self, pack_state_t* state, const char* path) {
+	// pack all the files in the trace, in order, relative to the root directory
+
+	int const root_fd = open(path, O_RDONLY | O_DIRECTORY);
+
+	if (root_fd < 0) { // root isn't a directory, so there's no layout to speak of
+		state->layout_count = 0;
+		return 0;
+	}
+
+	for (size_t i = 0; i < state->layout_count; i++) {
+		pack_layout_t* const entry = &state->layout[i];
+		char* const name = strrchr(entry->path, '/');
+
+		// paths the walk won't get to would be packed without ever being referenced by a directory table, so they're skipped
+
+		if (!__layout_reachable(entry->path)) {
+			fprintf(stderr, "WARNING Path '%s' in layout trace isn't inside the tree being packed; will be ignored\n", entry->path);
+			continue;
+		}
+
+		// files which have since been removed (or are now directories) are simply skipped
+
+		struct stat sb;
+
+		if (!*entry->path || fstatat(root_fd, entry->path, &sb, 0) < 0 || !S_ISREG(sb.st_mode)) {
+			continue;
+		}
+
+		iar_node_t base_node;
+		iar_node_t* base = NULL;
+		uint64_t base_mtime = 0;
+
+		if (self->base && __find_node_path(self->base, &base_node, entry->path, &base_mtime) != -1ull) {
+			base = &base_node;
+		}
+
+		scan_entry_t const file_entry = { 0 };
+		subtree_totals_t totals;
+
+		uint64_t const offset = __pack_node(self, state, &entry->node, &totals, root_fd, entry->path, name ? name + 1 : entry->path, &file_entry, base, base_mtime);
+
+		if (offset == -1ull) {
+			close(root_fd);
+			return -1;
+		}
+
+		if (offset != -2ull) {
+			entry->packed = 1;
+			entry->offset = offset;
+			entry->mtime = totals.mtime;
+		}
+	}
+
+	close(root_fd);
+
+	// sort by path, so that the walk can look them up
+
+	qsort(state->layout, state->layout_count, sizeof *state->layout, __layout_path_cmp);
+	return 0;
+}
+
+static pack_layout_t* __layout_lookup(pack_state_t* state, size_t bottom, const char* name) {
+	// build the path of the entry relative to the root (i.e. excluding the name of the bottom frame)
+
+	size_t bytes = strlen(name) + 1;
+
+	for (size_t i = bottom + 1; i < state->frame_count; i++) {
+		bytes += strlen(state->frames[i].name) + 1;
+	}
+
+	if (bytes > state->layout_path_capacity) {
+		state->layout_path_capacity = bytes * 2;
+		state->layout_path = realloc(state->layout_path, state->layout_path_capacity);
+	}
+
+	char* out = state->layout_path;
+
+	for (size_t i = bottom + 1; i < state->frame_count; i++) {
+		out = stpcpy(out, state->frames[i].name);
+		*out++ = '/';
+	}
+
+	strcpy(out, name);
+
+	pack_layout_t const key = { .path = state->layout_path };
+	pack_layout_t* const entry = bsearch(&key, state->layout, state->layout_count, sizeof *state->layout, __layout_lookup_cmp);
+
+	return entry && entry->packed ? entry : NULL;
+}
+
+static iar_dirent_t* __pack_base_child(pack_frame_t* frame, const char* name) {
+	// find the child of the base directory with the given name, if there is one
+	// entries are packed in order, so just advance through the base directory's children until we reach (or pass) it, in a single pass over the whole directory
+	// (if the base directory isn't sorted, e.g. because it was packed from JSON, this only misses some of the children which could've been reused)
+
+	iar_dirent_t* const dirent = &frame->base_dir.dirent;
+
+	while (frame->has_base) {
+		if (!frame->base_pending && !iar_readdir(&frame->base_dir)) { // none left
+			iar_closedir(&frame->base_dir);
+			frame->has_base = 0;
+
+			break;
+		}
+
+		int const cmp = strcmp(dirent->name, name);
+		frame->base_pending = cmp > 0;
+
+		if (cmp == 0) {
+			return dirent;
+		}
+
+		if (cmp > 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static uint64_t pack_walk(iar_file_t* self, pack_state_t* state, iar_node_t* node, subtree_totals_t* totals, int dir_fd, const char* path, const char* name, int is_dir, scan_dir_t* scan, iar_node_t* base_node) { // return offset, -1 if failure, -2 if file to be ignored
+	PROBE2(pack_walk_entry, path, name);
+	size_t const bottom = state->frame_count;
+
+	scan_entry_t const root_entry = {
+		.is_dir = is_dir,
+		.dir = scan,
+	};
+
+	uint64_t const offset = __pack_node(self, state, node, totals, dir_fd, path, name, &root_entry, base_node, 0);
+
+	if (offset == -1ull || offset == -2ull || state->frame_count == bottom) { // failed, ignored, or just a file
+		PROBE3(pack_walk_return, path, offset, offset >= -2ull ? 0 : totals->bytes);
+		return offset;
+	}
+
+	while (state->frame_count > bottom) {
+		size_t const top = state->frame_count - 1;
+		pack_frame_t* frame = &state->frames[top];
+		scan_dir_t* const frame_scan = frame->scan ? frame->scan : &frame->local_scan;
+
+		scan_entry_t* const entry = scan_dir_next(frame_scan, &frame->index);
+
+		if (entry) {
+			// if this file has already been packed according to the layout, all that's left to do is add it to the table
+
+			pack_layout_t* const laid_out = state->layout_count && !entry->is_dir ? __layout_lookup(state, bottom, entry->name) : NULL;
+
+			if (laid_out) {
+				subtree_totals_t laid_out_totals = {
+					.bytes = laid_out->node.data_bytes,
+					.mtime = laid_out->mtime,
+				};
+
+				if (__dir_table_add(frame->table, laid_out->offset, &laid_out->node, &laid_out_totals, entry->name) < 0) {
+					goto error;
+				}
+
+				continue;
+			}
+
+			// find the corresponding node in the base archive, if there is one
+			// (it's copied out of the frame's base directory, as the frame may move once the child is packed)
+
+			iar_dirent_t* const base_dirent = __pack_base_child(frame, entry->name);
+
+			iar_node_t base_child_node;
+			iar_node_t* base_child = NULL;
+			uint64_t base_child_mtime = 0;
+
+			if (base_dirent) {
+				base_child_node = base_dirent->node;
+				base_child = &base_child_node;
+				base_child_mtime = base_dirent->mtime;
+			}
+
+			int const frame_fd = __pack_frame_fd(state, bottom, top);
+
+			if (frame_fd < 0) {
+				goto error;
+			}
+
+			iar_node_t child_node;
+			subtree_totals_t child_totals;
+
+			uint64_t child_offset = __pack_node(self, state, &child_node, &child_totals, frame_fd, entry->name, entry->name, entry, base_child, base_child_mtime);
+
+			if (child_offset == -2ull) { // is to be ignored?
+				continue;
+			}
+
+			if (child_offset == -1ull) {
+				goto error;
+			}
+
+			if (child_node.is_dir) { // directories add themselves to their parent's table once they're done
+				continue;
+			}
+
+			if (__dir_table_add(state->frames[top].table, child_offset, &child_node, &child_totals, entry->name) < 0) {
+				goto error;
+			}
+
+			continue;
+		}
+
+		if (frame->index < frame_scan->entry_count) { // failed to read back spilled entries
+			goto error;
+		}
+
+		// all entries have been packed, so write the directory table & its node
+
+		subtree_totals_t dir_totals;
+
+		if (__dir_table_write(self, frame->table, &frame->node, &dir_totals) < 0) {
+			goto error;
+		}
+
+		if (__write(self, &frame->node, sizeof frame->node, frame->offset) < 0) {
+			goto error;
+		}
+
+		uint64_t const dir_offset = frame->offset;
+		iar_node_t dir_node = frame->node;
+		const char* const dir_name = frame->name; // owned by the parent's scan, so still valid after popping
+
+		__pack_pop(state);
+
+		if (state->frame_count == bottom) {
+			*node = dir_node;
+			*totals = dir_totals;
+
+			break;
+		}
+
+		frame = &state->frames[state->frame_count - 1];
+
+		if (__dir_table_add(frame->table, dir_offset, &dir_node, &dir_totals, dir_name) < 0) {
+			goto error;
+		}
+	}
+
+	PROBE3(pack_walk_return, path, offset, totals->bytes);
+	return offset;
+
+error:
+
+	while (state->frame_count > bottom) {
+		__pack_pop(state);
+	}
+
+	PROBE3(pack_walk_return, path, -1ull, 0);
+	return -1; // propagate error
+}
+
+// like packing, directories being unpacked are kept on an explicit stack rather than the call stack
+// the nodes in a directory (and their names) are read 'IAR_IO_BATCH_OPS' at a time, as a batch of independent reads
+
+typedef struct {
+	iar_node_t node;
+	char* name;
+} unpack_child_t;
+
+typedef struct {
+	size_t dir; // index in 'plan->dirs'
+
+	uint64_t* node_offsets; // this buffer (& 'children') is reused by the next directory at the same depth
+	uint64_t node_offsets_capacity;
+
+	uint64_t node_count;
+	uint64_t index;
+
+	unpack_child_t* children; // the current batch of 'IAR_IO_BATCH_OPS' nodes
+	uint64_t children_start;
+	uint64_t children_end;
+} unpack_frame_t;
+
+typedef struct {
+	unpack_frame_t* frames;
+
+	size_t frame_count;
+	size_t frames_allocated; // frames with their own 'node_offsets' buffer
+	size_t frames_capacity;
+
+	iar_io_op_t ops[IAR_IO_BATCH_OPS];
+} unpack_stack_t;
+
+static size_t __unpack_add_dir(unpack_plan_t* plan, size_t parent, char* name) {
+	if (plan->dir_count >= plan->dirs_capacity) {
+		plan->dirs_capacity = plan->dirs_capacity ? plan->dirs_capacity * 2 : 64;
+		plan->dirs = realloc(plan->dirs, plan->dirs_capacity * sizeof *plan->dirs);
+	}
+
+	plan->dirs[plan->dir_count] = (unpack_dir_t) {
+		.parent = parent,
+		.name = name,
+		.fd = -1,
+	};
+
+	return plan->dir_count++;
+}
+
+static int __unpack_dir_fd(unpack_plan_t* plan, size_t index) {
+	if (plan->dirs[index].fd >= 0) {
+		return plan->dirs[index].fd;
+	}
+
+	// find the nearest ancestor which is still open & reopen everything from there on down
+
+	size_t count = 0;
+
+	for (size_t i = index; i != UNPACK_OUTPUT && plan->dirs[i].fd < 0; i = plan->dirs[i].parent) {
+		if (count >= plan->chain_capacity) {
+			plan->chain_capacity = plan->chain_capacity ? plan->chain_capacity * 2 : 64;
+			plan->chain = realloc(plan->chain, plan->chain_capacity * sizeof *plan->chain);
+		}
+
+		plan->chain[count++] = i;
+	}
+
+	while (count--) {
+		unpack_dir_t* const dir = &plan->dirs[plan->chain[count]];
+		int const parent_fd = dir->parent == UNPACK_OUTPUT ? AT_FDCWD : plan->dirs[dir->parent].fd;
+
+		dir->fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY);
+
+		if (dir->fd < 0) {
+			fprintf(stderr, "ERROR Failed to open directory '%s' (%s)\n", dir->name, strerror(errno));
+			return -1;
+		}
+
+		// the parent was opened just before, so it's never the oldest one to be closed here (unless there's only room for one)
+
+		if (plan->open_count < IAR_MAX_OPEN_DIRS) {
+			plan->open_dirs[plan->open_count++] = plan->chain[count];
+			continue;
+		}
+
+		size_t* const oldest = &plan->open_dirs[plan->open_next];
+
+		close(plan->dirs[*oldest].fd);
+		plan->dirs[*oldest].fd = -1;
+
+		*oldest = plan->chain[count];
+		plan->open_next = (plan->open_next + 1) % IAR_MAX_OPEN_DIRS;
+	}
+
+	return plan->dirs[index].fd;
+}
+
+static int __unpack_node(iar_file_t* self, unpack_stack_t* stack, size_t parent, char* name, iar_node_t* node, unpack_plan_t* plan) {
+	if (!node->is_dir) { // handle files
+		// defer actually writing the file until we know where all the other files are
 
-// functions for reading iar files
+		if (plan->job_count >= plan->jobs_capacity) {
+			plan->jobs_capacity = plan->jobs_capacity ? plan->jobs_capacity * 2 : 64;
+			plan->jobs = realloc(plan->jobs, plan->jobs_capacity * sizeof *plan->jobs);
+		}
 
-uint64_t iar_find_node(iar_file_t* self, iar_node_t* node, char const* name, iar_node_t* parent) {
-	// read what we need from parent before anything else, because there's a chance parent == node
+		unpack_job_t* const job = &plan->jobs[plan->job_count++];
 
-	uint64_t const parent_node_count = parent->node_count;
-	uint64_t const parent_node_offsets_offset = parent->node_offsets_offset;
+		job->dir = parent;
+		job->name = name;
+		job->data_offset = node->data_offset;
+		job->data_bytes = node->data_bytes;
 
-	uint64_t const node_offset_bytes = parent_node_count * sizeof(uint64_t);
-	uint64_t* const node_offsets = malloc(node_offset_bytes);
+		plan->total_bytes += job->data_bytes;
+		return 0;
+	}
 
-	pread(self->fd, node_offsets, node_offset_bytes, parent_node_offsets_offset);
+	// handle directories
+	// (read all the node offsets, create the directory to write in, and leave the nodes in it for later)
 
-	uint64_t index = 0;
+	int const parent_fd = __unpack_dir_fd(plan, parent);
 
-	for (; index < parent_node_count; index++) {
-		iar_node_t child_node;
-		pread(self->fd, &child_node, sizeof child_node, node_offsets[index]);
+	if (parent_fd < 0) {
+		return -1;
+	}
 
-		char* const node_name = malloc(child_node.name_bytes);
-		pread(self->fd, node_name, child_node.name_bytes, child_node.name_offset);
+	mkdirat(parent_fd, name, 0700);
 
-		if (strncmp(name, node_name, child_node.name_bytes) == 0) {
-			memcpy(node, &child_node, sizeof child_node);
-			goto found;
-		}
+	if (stack->frame_count >= stack->frames_capacity) {
+		stack->frames_capacity = stack->frames_capacity ? stack->frames_capacity * 2 : 16;
+		stack->frames = realloc(stack->frames, stack->frames_capacity * sizeof *stack->frames);
 	}
 
-	return -1;
+	if (stack->frame_count >= stack->frames_allocated) { // frames which have never been used before
+		unpack_frame_t* const frame = &stack->frames[stack->frames_allocated++];
 
-found:
+		frame->node_offsets = NULL;
+		frame->node_offsets_capacity = 0;
+		frame->children = malloc(IAR_IO_BATCH_OPS * sizeof *frame->children);
+	}
 
-	return index;
-}
+	unpack_frame_t* const frame = &stack->frames[stack->frame_count++];
 
-int iar_read_node_name(iar_file_t* self, iar_node_t* node, char* buf) {
-	return pread(self->fd, buf, node->name_bytes, node->name_offset) == -1;
-}
+	frame->dir = __unpack_add_dir(plan, parent, name);
+	frame->node_count = node->node_count;
+	frame->index = 0;
 
-int iar_read_node_content /* content not contents */ (iar_file_t* self, iar_node_t* node, char* buf) {
-	if (node->is_dir) {
-		fprintf(stderr, "ERROR Provided node is not a file and thus contains no data\n");
-		return -1;
-	}
+	frame->children_start = 0;
+	frame->children_end = 0;
 
-	pread(self->fd, buf, node->data_bytes, node->data_offset);
-	return 0;
-}
+	uint64_t node_offsets_bytes = node->node_count * sizeof(uint64_t);
 
-int iar_map_node_content /* content not contents */ (iar_file_t* self, iar_node_t* node, void* address) {
-	if (node->is_dir) {
-		fprintf(stderr, "ERROR Provided node is not a file and thus contains no data\n");
-		return -1;
+	if (node->node_count > frame->node_offsets_capacity) {
+		frame->node_offsets_capacity = node->node_count;
+		frame->node_offsets = realloc(frame->node_offsets, node_offsets_bytes);
 	}
 
-
-	if (mmap(address, node->data_bytes, PROT_READ, MAP_PRIVATE | MAP_FIXED, self->fd, node->data_offset) == MAP_FAILED) {
-		fprintf(stderr, "ERROR Couldn't map file to memory (%s)\n", strerror(errno));
+	if (__read(self, frame->node_offsets, node_offsets_bytes, node->node_offsets_offset) != (ssize_t) node_offsets_bytes) {
+		fprintf(stderr, "ERROR Failed to read node offsets\n");
 		return -1;
 	}
 
 	return 0;
 }
 
-// functions for writing to iar files
-
-int iar_write_header(iar_file_t* self) {
-	return pwrite(self->fd, &self->header, sizeof(self->header), 0) == -1;
-}
-
-// functions for packing and unpacking iar files
-// TODO 'uint64_t' vs 'int' for return types?
-
-static uint64_t pack_walk(iar_file_t* self, const char* path, const char* name); // return offset, -1 if failure, -2 if file to be ignored
-static int unpack_walk(iar_file_t* self, const char* path, iar_node_t* node);
-
-#if !defined(WITHOUT_JSON)
-	static uint64_t pack_json_walk(iar_file_t* self, json_value_t* member, const char* name); // return offset, -1 if failure, -2 if file to be ignored
-#endif
+static int __unpack_read_children(iar_file_t* self, unpack_stack_t* stack, unpack_frame_t* frame) {
+	// read the next batch of nodes, and then all of their names
 
-// get the last bit of path & use that as a name (if user doesn't specify a name himself)
-// a bit ugly but it gets the job done
+	uint64_t const count = MIN(frame->node_count - frame->index, IAR_IO_BATCH_OPS);
+	iar_io_op_t* const ops = stack->ops;
 
-static inline char* __iar_pack_gen_name(const char* path, const char* _name) {
-	if (_name) {
-		return strdup(++_name); // so we have something to free
+	for (uint64_t i = 0; i < count; i++) {
+		ops[i] = (iar_io_op_t) {
+			.fd = -1,
+			.buf = &frame->children[i].node,
+			.bytes = sizeof frame->children[i].node,
+			.offset = frame->node_offsets[frame->index + i],
+		};
 	}
 
-	char* abs_path = realpath(path, NULL);
-	char* name = abs_path + strlen(abs_path) - 1; // go to end of absolute path
+	if (__io_batch(self, ops, count) < 0) {
+		return -1;
+	}
 
-	for (; name >= abs_path && *name != '/'; name--); // move backwards until we find a path delimiter or we reach the beginning of the absolute path
+	for (uint64_t i = 0; i < count; i++) {
+		unpack_child_t* const child = &frame->children[i];
 
-	name = strdup(++name);
-	free(abs_path);
+		if (ops[i].rv != sizeof child->node || !child->node.name_bytes) {
+			fprintf(stderr, "ERROR Failed to read node\n");
+			return -1;
+		}
 
-	return name;
-}
+		// names live until the whole unpack is done, so they're taken from the arena
 
-int iar_pack(iar_file_t* self, const char* path, const char* _name) {
-	char* name = __iar_pack_gen_name(path, _name);
+		child->name = __arena_alloc(self, child->node.name_bytes);
 
-	// walk
+		ops[i] = (iar_io_op_t) {
+			.fd = -1,
+			.buf = child->name,
+			.bytes = child->node.name_bytes,
+			.offset = child->node.name_offset,
+		};
+	}
 
-	self->current_offset = sizeof(self->header);
-	int error = (self->header.root_node_offset = pack_walk(self, path, name)) == -1ull;
+	if (__io_batch(self, ops, count) < 0) {
+		return -1;
+	}
 
-	free(name);
-	return -error;
-}
+	for (uint64_t i = 0; i < count; i++) {
+		char* const name = ops[i].buf;
+		name[ops[i].bytes - 1] = '\0'; // just to be sure
+	}
 
-#if !defined(WITHOUT_JSON)
+	frame->children_start = frame->index;
+	frame->children_end = frame->index + count;
 
-int iar_pack_json(iar_file_t* self, const char* path, const char* _name) {
-	char* name = __iar_pack_gen_name(path, _name);
+	return 0;
+}
 
+static int unpack_walk(iar_file_t* self, const char* path, iar_node_t* node, unpack_plan_t* plan) {
 	int rv = -1;
+	unpack_stack_t stack = { 0 };
 
-	FILE* fp = fopen(path, "rb");
+	PROBE2(unpack_walk_entry, path, node->node_count);
+	uint64_t const start = __now_ns();
 
-	if (!fp) {
-		fprintf(stderr, "ERROR Failed to open '%s'\n", path);
+	char* const name = __arena_alloc(self, node->name_bytes);
+
+	if (__read(self, name, node->name_bytes, node->name_offset) != (ssize_t) node->name_bytes) {
+		fprintf(stderr, "ERROR Failed to read node name\n");
 		goto error;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	size_t bytes = ftell(fp);
+	name[node->name_bytes - 1] = '\0'; // just to be sure
 
-	char* raw = malloc(bytes + 1);
-	raw[bytes] = '\0'; // just to be sure
+	size_t const output = __unpack_add_dir(plan, UNPACK_OUTPUT, (char*) path);
 
-	rewind(fp);
-	fread(raw, 1, bytes, fp);
+	if (__unpack_node(self, &stack, output, name, node, plan) < 0) {
+		goto error;
+	}
 
-	fclose(fp);
+	while (stack.frame_count) {
+		unpack_frame_t* const frame = &stack.frames[stack.frame_count - 1];
 
-	json_value_t* json = json_parse(raw, strlen(raw));
+		if (frame->index >= frame->node_count) {
+			stack.frame_count--;
+			continue;
+		}
 
-	if (!json) {
-		fprintf(stderr, "ERROR Failed to parse JSON\n");
-		goto error_json;
-	}
+		if (frame->index >= frame->children_end && __unpack_read_children(self, &stack, frame) < 0) {
+			goto error;
+		}
 
-	self->current_offset = sizeof(self->header);
-	self->header.root_node_offset = pack_json_walk(self, json, name);
+		// the children buffer isn't moved when pushing a frame (unlike the frame itself), so it's fine to pass a pointer into it
 
-	if (self->header.root_node_offset == -1ull) {
-		goto error_json;
+		unpack_child_t* const child = &frame->children[frame->index++ - frame->children_start];
+
+		if (__unpack_node(self, &stack, frame->dir, child->name, &child->node, plan) < 0) {
+			goto error;
+		}
 	}
 
-	rv = 0; // success
+	rv = 0;
 
-error_json:
+error:
 
-	free(json);
+	for (size_t i = 0; i < stack.frames_allocated; i++) {
+		free(stack.frames[i].node_offsets);
+		free(stack.frames[i].children);
+	}
 
-error:
+	free(stack.frames);
+	__phase_end(self, IAR_PHASE_UNPACK_WALK, start);
 
-	free(name);
+	PROBE2(unpack_walk_return, path, rv);
 	return rv;
 }
 
-#endif
+static int __unpack_job_cmp(const void* _a, const void* _b) {
+	const unpack_job_t* a = _a;
+	const unpack_job_t* b = _b;
 
-int iar_unpack(iar_file_t* self, const char* path) {
-	mkdir(path, 0700);
-	return unpack_walk(self, path, &self->root_node);
+	return (a->data_offset > b->data_offset) - (a->data_offset < b->data_offset);
 }
 
-// static functions
+// with backends which batch operations, data is read & written in a pipeline instead (see '__io_pipeline')
+// files are opened when their first chunk is read, and closed once their last chunk has been written
 
-#define NODE_OFFSET(node) \
-	(node).data_offset = (self->current_offset & ~(self->header.page_bytes - 1)) + self->header.page_bytes; \
-	self->current_offset = (node).data_offset;
+typedef struct {
+	int fd;
+	int last;
 
-#define WRITE_NODE_OFFSETS(node, node_offsets_buf) \
-	uint64_t node_offsets_bytes = (node).node_count * sizeof *(node_offsets_buf); \
-	\
-	(node).node_offsets_offset = self->current_offset; \
-	self->current_offset += node_offsets_bytes; \
-	\
-	pwrite(self->fd, (node_offsets_buf), node_offsets_bytes, (node).node_offsets_offset);
+	uint8_t* buf;
+	uint64_t bytes;
+	uint64_t offset; // in the file
+} unpack_chunk_t;
 
-static inline uint64_t __create_node(iar_file_t* self, iar_node_t* node, const char* name) {
-	// create node
+static int __unpack_open(unpack_plan_t* plan, unpack_job_t* job) {
+	int const dir_fd = __unpack_dir_fd(plan, job->dir);
 
-	uint64_t offset = self->current_offset;
-	self->current_offset += sizeof *node;
+	if (dir_fd < 0) {
+		return -1;
+	}
 
-	// write node name
+	int const fd = openat(dir_fd, job->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-	node->name_bytes = strlen(name) + 1;
-	node->name_offset = self->current_offset;
+	if (fd < 0) {
+		fprintf(stderr, "ERROR Failed to open '%s' for writing (%s)\n", job->name, strerror(errno));
+		return -1;
+	}
 
-	pwrite(self->fd, name, node->name_bytes, node->name_offset);
-	self->current_offset += node->name_bytes;
+	// we already know exactly how big the file is going to be, so allocate it all at once to avoid fragmentation
 
-	return offset;
+#if defined(__linux__)
+	if (job->data_bytes) {
+		fallocate(fd, 0, 0, job->data_bytes);
+	}
+#endif
+
+	return fd;
 }
 
-static inline int __pack_stream_node(iar_file_t* self, iar_node_t* node, const char* path) {
-	// open the file
+static int __unpack_plan_pipeline(iar_file_t* self, unpack_plan_t* plan) {
+	int rv = -1;
 
-	FILE* fp = fopen(path, "rb");
+	uint8_t* const pipeline = __io_pipeline(self);
+	iar_io_op_t ops[IAR_IO_BATCH_OPS];
 
-	if (!fp) {
-		fprintf(stderr, "ERROR Failed to open '%s'\n", path);
-		return -1;
-	}
+	unpack_chunk_t chunks[2][PIPELINE_CHUNKS];
+	size_t chunk_counts[2] = { 0, 0 };
 
-	// write the data
+	size_t job_index = 0;
+	uint64_t job_offset = 0; // how much of the current job has already been read (or is being read)
+	int job_fd = -1;
 
-	NODE_OFFSET(*node)
-	node->data_bytes = 0;
+	uint64_t bytes_done = 0;
+	int half = 0;
 
-	uint8_t* block = malloc(IAR_MAX_READ_BLOCK_SIZE);
+	for (;;) {
+		int const prev = !half;
+		size_t count = 0;
 
-	while (!feof(fp)) {
-		size_t bytes_read = fread(block, 1, IAR_MAX_READ_BLOCK_SIZE, fp);
-		pwrite(self->fd, block, bytes_read, self->current_offset);
+		// read the next chunks into this half
 
-		node->data_bytes += bytes_read;
-		self->current_offset += bytes_read;
-	}
+		while (chunk_counts[half] < PIPELINE_CHUNKS && job_index < plan->job_count) {
+			unpack_job_t* const job = &plan->jobs[job_index];
 
-	free(block);
-	fclose(fp);
+			if (job_fd < 0 && (job_fd = __unpack_open(plan, job)) < 0) {
+				goto error;
+			}
 
-	return 0;
-}
+			if (!job->data_bytes) {
+				close(job_fd);
+				job_fd = -1;
 
-static uint64_t pack_walk(iar_file_t* self, const char* path, const char* name) { // return offset, -1 if failure, -2 if file to be ignored
-	// make sure the file to be read is not our output (this can create infinite loops)
+				job_index++;
+				continue;
+			}
 
-	char* absolute_path = realpath(path, NULL);
+			unpack_chunk_t* const chunk = &chunks[half][chunk_counts[half]];
 
-	if (strcmp(absolute_path, self->absolute_path) == 0) {
-		free(absolute_path);
-		return -2;
-	}
+			chunk->fd = job_fd;
+			chunk->buf = pipeline + half * PIPELINE_BYTES + chunk_counts[half]++ * IAR_MAX_READ_BLOCK_SIZE;
+			chunk->bytes = MIN(job->data_bytes - job_offset, IAR_MAX_READ_BLOCK_SIZE);
+			chunk->offset = job_offset;
 
-	free(absolute_path);
+			ops[count++] = (iar_io_op_t) {
+				.fd = -1,
+				.buf = chunk->buf,
+				.bytes = chunk->bytes,
+				.offset = job->data_offset + job_offset,
+			};
 
-	iar_node_t node;
-	uint64_t offset = __create_node(self, &node, name);
+			job_offset += chunk->bytes;
+			chunk->last = job_offset == job->data_bytes;
 
-	// btw, the order of what comes where is not specified by the standard
-	// so long as all offsets point to the right place, you've got nothing to worry about
-	// so if you want, you can put the node data after the name (weirdo), whatever you want
+			if (chunk->last) {
+				job_fd = -1; // the chunk is now responsible for closing it
+				job_offset = 0;
+				job_index++;
+			}
+		}
 
-	DIR* dp = opendir(path);
+		size_t const read_count = count;
 
-	if (!dp) { // handle files
-		node.is_dir = 0;
+		// & meanwhile, write out what was read into the other half
 
-		if (__pack_stream_node(self, &node, path) < 0) {
-			return -1;
+		for (size_t i = 0; i < chunk_counts[prev]; i++) {
+			unpack_chunk_t* const chunk = &chunks[prev][i];
+
+			ops[count++] = (iar_io_op_t) {
+				.fd = chunk->fd,
+				.write = 1,
+				.buf = chunk->buf,
+				.bytes = chunk->bytes,
+				.offset = chunk->offset,
+			};
 		}
 
-		goto end;
-	}
+		if (!count) {
+			break;
+		}
 
-	// handle directories
+		if (__io_batch(self, ops, count) < 0) {
+			goto error;
+		}
 
-	node.is_dir = 1;
+		for (size_t i = 0; i < read_count; i++) {
+			if (ops[i].rv != (ssize_t) ops[i].bytes) {
+				fprintf(stderr, "ERROR Failed to read file data from archive\n");
+				goto error;
+			}
+		}
 
-	node.node_count = 0;
-	uint64_t* node_offsets_buf = NULL;
+		for (size_t i = 0; i < chunk_counts[prev]; i++) {
+			unpack_chunk_t* const chunk = &chunks[prev][i];
+			iar_io_op_t* const op = &ops[read_count + i];
 
-	struct dirent* entry;
+			if (op->rv != (ssize_t) op->bytes) {
+				fprintf(stderr, "ERROR Failed to write file data (%s)\n", strerror(errno));
+				goto error;
+			}
 
-	while ((entry = readdir(dp)) != NULL) {
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-			continue;
-		}
+			if (chunk->last) {
+				close(chunk->fd);
+				chunk->last = 0;
+			}
 
-		char* path_buf = malloc(strlen(path) + strlen(entry->d_name) + 2 /* strlen("/") + 1 */);
-		sprintf(path_buf, *path ? "%s/%s" : "%s%s", path, entry->d_name);
+			bytes_done += chunk->bytes;
+		}
 
-		uint64_t child_offset = pack_walk(self, path_buf, entry->d_name);
-		free(path_buf);
+		chunk_counts[prev] = 0;
 
-		if (child_offset == -2ull) { // is to be ignored?
-			continue;
+		if (self->progress) {
+			self->progress(self, bytes_done, plan->total_bytes);
 		}
 
-		if (child_offset == -1ull) {
-			if (node_offsets_buf) {
-				free(node_offsets_buf);
-			}
+		half = prev;
+	}
 
-			closedir(dp);
-			return -1; // propagate error
+	rv = 0;
+
+error:
+
+	if (job_fd >= 0) {
+		close(job_fd);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		for (size_t j = 0; j < chunk_counts[i]; j++) {
+			if (chunks[i][j].last) {
+				close(chunks[i][j].fd);
+			}
 		}
+	}
+
+	return rv;
+}
+
+// while writing out one file, the kernel is asked to start reading in the data that comes after it, so that reads & writes overlap
+// readahead alone wouldn't get this right, as there are gaps between files (nodes, names, padding)
+// this is kept to a window of 'UNPACK_READAHEAD_BYTES' ahead of what's being written (topped back up once half of it has been consumed), so that big files don't evict everything else from the page cache
+
+#define UNPACK_READAHEAD_BYTES (4 << 20) // 4 MiB
+
+typedef struct {
+	size_t job; // job & offset within it up until which the kernel has been asked to read
+	uint64_t offset;
+	uint64_t bytes; // total file data asked for so far
+} unpack_readahead_t;
 
-		node_offsets_buf = realloc(node_offsets_buf, (node.node_count + 1) * sizeof *node_offsets_buf);
-		node_offsets_buf[node.node_count++] = child_offset;
+static void __unpack_readahead(iar_file_t* self, unpack_plan_t* plan, unpack_readahead_t* ra, uint64_t bytes_done) {
+	if (ra->bytes >= bytes_done + UNPACK_READAHEAD_BYTES / 2) {
+		return;
 	}
 
-	// write the offsets
+	uint64_t const target = bytes_done + UNPACK_READAHEAD_BYTES;
 
-	WRITE_NODE_OFFSETS(node, node_offsets_buf)
-	free(node_offsets_buf);
+	while (ra->job < plan->job_count && ra->bytes < target) {
+		unpack_job_t* const job = &plan->jobs[ra->job];
+		uint64_t const bytes = MIN(job->data_bytes - ra->offset, target - ra->bytes);
 
-	closedir(dp);
+		if (bytes) {
+			posix_fadvise(self->fd, self->base_offset + job->data_offset + ra->offset, bytes, POSIX_FADV_WILLNEED);
+		}
 
-end:
+		ra->offset += bytes;
+		ra->bytes += bytes;
 
-	pwrite(self->fd, &node, sizeof node, offset);
-	return offset;
+		if (ra->offset == job->data_bytes) {
+			ra->job++;
+			ra->offset = 0;
+		}
+	}
 }
 
-static int unpack_walk(iar_file_t* self, const char* path, iar_node_t* node) {
+static int unpack_plan_run(iar_file_t* self, unpack_plan_t* plan) {
 	int rv = -1;
+	uint64_t const start = __now_ns();
 
-	// read name
+	qsort(plan->jobs, plan->job_count, sizeof *plan->jobs, __unpack_job_cmp);
 
-	char* name = malloc(node->name_bytes);
-	pread(self->fd, name, node->name_bytes, node->name_offset);
+	// tell the kernel we're about to read through the archive sequentially, so it can read ahead more aggressively
 
-	// get full path
+	posix_fadvise(self->fd, self->base_offset, 0, POSIX_FADV_SEQUENTIAL);
 
-	char* path_buf = malloc(strlen(path) + node->name_bytes + 1 /* -1 + strlen("/") + 1 */);
-	sprintf(path_buf, *path ? "%s/%s" : "%s%s", path, name);
+	if (self->io->batch) {
+		rv = __unpack_plan_pipeline(self, plan);
+		goto error;
+	}
+
+	uint8_t* const block = __io_buf(self);
+	uint64_t bytes_done = 0;
+
+	unpack_readahead_t ra = { 0 };
+
+	for (size_t i = 0; i < plan->job_count; i++) {
+		unpack_job_t* const job = &plan->jobs[i];
+		__unpack_readahead(self, plan, &ra, bytes_done);
 
-	if (!node->is_dir) { // handle files
 		// create file to write to
+		// (straight through its fd, as we've already got our own buffer)
 
-		FILE* fp = fopen(path_buf, "wb");
+		int const fd = __unpack_open(plan, job);
 
-		if (!fp) {
-			fprintf(stderr, "ERROR Failed to open '%s' for writing\n", path_buf);
+		if (fd < 0) {
 			goto error;
 		}
 
 		// write data to file
 
-		uint8_t* block = malloc(IAR_MAX_READ_BLOCK_SIZE);
-		uint64_t offset = node->data_offset;
+		uint64_t offset = job->data_offset;
 
-		for (int64_t left = node->data_bytes; left > 0; left -= IAR_MAX_READ_BLOCK_SIZE) {
+		for (int64_t left = job->data_bytes; left > 0; left -= IAR_MAX_READ_BLOCK_SIZE) {
 			size_t bytes_to_read = MIN((size_t) left, IAR_MAX_READ_BLOCK_SIZE);
 
-			pread(self->fd, block, bytes_to_read, offset);
-			fwrite(block, 1, bytes_to_read, fp);
-
-			offset += bytes_to_read;
-		}
+			const uint8_t* src = __peek(self, offset, bytes_to_read);
 
-		free(block);
-		fclose(fp);
+			if (src) {
+				STAT_ADD(self, bytes_read, bytes_to_read);
+				STAT_ADD(self, cache_hits, 1);
+			}
 
-		goto success;
-	}
+			else {
+				if (__read(self, block, bytes_to_read, offset) != (ssize_t) bytes_to_read) {
+					fprintf(stderr, "ERROR Failed to read file data from archive\n");
+					close(fd);
 
-	// handle directories
-	// (first read all the node offsets)
+					goto error;
+				}
 
-	uint64_t node_offsets_bytes = node->node_count * sizeof(uint64_t);
-	uint64_t* node_offsets = malloc(node_offsets_bytes);
+				src = block;
+			}
 
-	pread(self->fd, node_offsets, node_offsets_bytes, node->node_offsets_offset);
+			if (__pwrite_all(self, fd, src, bytes_to_read, offset - job->data_offset) != (ssize_t) bytes_to_read) {
+				fprintf(stderr, "ERROR Failed to write to '%s' (%s)\n", job->name, strerror(errno));
+				close(fd);
 
-	// create directory to write in and loop through all the nodes in it
+				goto error;
+			}
 
-	mkdir(path_buf, 0700);
+			offset += bytes_to_read;
+			bytes_done += bytes_to_read;
 
-	for (uint64_t i = 0; i < node->node_count; i++) {
-		iar_node_t node;
-		pread(self->fd, &node, sizeof node, node_offsets[i]);
+			__unpack_readahead(self, plan, &ra, bytes_done);
 
-		if (unpack_walk(self, path_buf, &node)) {
-			free(node_offsets);
-			goto error;
+			if (self->progress) {
+				self->progress(self, bytes_done, plan->total_bytes);
+			}
 		}
-	}
-
-	free(node_offsets);
 
-success:
+		close(fd);
+	}
 
 	rv = 0;
 
 error:
 
-	free(name);
-	free(path_buf);
+	unpack_plan_free(plan);
+	__phase_end(self, IAR_PHASE_UNPACK_DATA, start);
 
 	return rv;
 }
 
+static void unpack_plan_free(unpack_plan_t* plan) {
+	for (size_t i = 0; i < plan->dir_count; i++) {
+		if (plan->dirs[i].fd >= 0) {
+			close(plan->dirs[i].fd);
+		}
+	}
+
+	free(plan->jobs); // names are in the arena
+	free(plan->dirs);
+	free(plan->chain);
+}
+
 #if !defined(WITHOUT_JSON)
 
-static uint64_t pack_json_walk(iar_file_t* self, json_value_t* member, const char* name) {
+static uint64_t pack_json_walk(iar_file_t* self, pack_state_t* state, iar_node_t* node, subtree_totals_t* totals, json_value_t* member, const char* name) {
 	size_t type = member->type;
 	void* payload = member->payload;
 
-	// create node
-
-	iar_node_t node;
-	uint64_t offset = __create_node(self, &node, name);
+	uint64_t offset;
 
 	// handle "files"
 
 	if (type == json_type_string) {
-		node.is_dir = 0;
+		offset = __create_file_node(self, node, name);
 		json_str_t* _str = payload;
 
+		if (offset == -1ull) {
+			return -1;
+		}
+
 		size_t len = _str->string_size;
 		char* str = (void*) _str->string;
 
@@ -503,7 +5331,17 @@ static uint64_t pack_json_walk(iar_file_t* self, json_value_t* member, const cha
 			str += JSON_IAR_PATH_PREFIX_LEN;
 			len -= JSON_IAR_PATH_PREFIX_LEN;
 
-			if (__pack_stream_node(self, &node, str) < 0) {
+			int const fd = open(str, O_RDONLY);
+
+			if (fd < 0) {
+				fprintf(stderr, "ERROR Failed to open '%s' (%s)\n", str, strerror(errno));
+				return -1;
+			}
+
+			int const rv = __pack_stream_node(self, node, fd, -1);
+			close(fd);
+
+			if (rv < 0) {
 				return -1;
 			}
 
@@ -512,11 +5350,13 @@ static uint64_t pack_json_walk(iar_file_t* self, json_value_t* member, const cha
 
 		// write string data
 
-		NODE_OFFSET(node)
-		node.data_bytes = len; // includes NULL-byte
+		node->data_bytes = len; // includes NULL-byte
+
+		if (__write(self, str, node->data_bytes, self->current_offset) < 0) {
+			return -1;
+		}
 
-		pwrite(self->fd, str, node.data_bytes, self->current_offset);
-		self->current_offset += node.data_bytes;
+		self->current_offset += node->data_bytes;
 
 		goto end;
 	}
@@ -529,40 +5369,53 @@ static uint64_t pack_json_walk(iar_file_t* self, json_value_t* member, const cha
 		return -2;
 	}
 
-	node.is_dir = 1;
+	offset = __create_node(self, node, name);
+	node->is_dir = 1;
 
-	node.node_count = 0;
-	uint64_t* node_offsets_buf = NULL;
+	if (offset == -1ull) {
+		return -1;
+	}
 
+	dir_table_t* const table = __dir_table_acquire(state);
 	json_obj_t* obj = payload;
 
 	for (json_member_t* child = obj->start; child; child = child->next) {
-		uint64_t child_offset = pack_json_walk(self, child->value, child->name->string);
+		iar_node_t child_node;
+		subtree_totals_t child_totals;
+
+		uint64_t child_offset = pack_json_walk(self, state, &child_node, &child_totals, child->value, child->name->string);
 
 		if (child_offset == -2ull) { // is to be ignored?
 			continue;
 		}
 
-		if (child_offset == -1ull) {
-			if (node_offsets_buf) {
-				free(node_offsets_buf);
-			}
-
+		if (child_offset == -1ull || __dir_table_add(table, child_offset, &child_node, &child_totals, child->name->string) < 0) {
+			__dir_table_release(state, table);
 			return -1; // propagate error
 		}
-
-		node_offsets_buf = realloc(node_offsets_buf, (node.node_count + 1) * sizeof *node_offsets_buf);
-		node_offsets_buf[node.node_count++] = child_offset;
 	}
 
-	// write the offsets
+	// write the directory table
 
-	WRITE_NODE_OFFSETS(node, node_offsets_buf)
-	free(node_offsets_buf);
+	int const rv = __dir_table_write(self, table, node, totals);
+	__dir_table_release(state, table);
+
+	if (rv < 0) {
+		return -1;
+	}
 
 end:
 
-	pwrite(self->fd, &node, sizeof node, offset);
+	if (!node->is_dir) {
+		totals->bytes = node->data_bytes;
+		totals->entries = 0;
+		totals->mtime = 0; // there's nothing to take an mtime from
+	}
+
+	if (__write(self, node, sizeof *node, offset) < 0) {
+		return -1;
+	}
+
 	return offset;
 }
 
@@ -0,0 +1,30 @@
+#!/bin/sh
+set -e
+
+# benchmarks libiar on synthetic trees (see src/bench/main.c)
+# this is kept small so as not to hold up the other tests, but it still checks that every backend can pack, unpack, find, read & map every kind of tree
+# reads, maps & asynchronous requests are checked against the files they were packed from, so this also covers the asynchronous, prefetching, pinning & in-memory APIs
+# for actual measurements, run 'iar-bench' with a bigger '--scale' & '--repeat', & compare against a previous run with '--baseline'
+
+iar-bench --repeat 1 --samples 1000 > bench.tsv
+cat bench.tsv
+
+for tree in tiny wide deep huge sparse; do
+	for bench in pack unpack find_node find_path read map prefetch async; do
+		grep -q "^$tree	pread	$bench	" bench.tsv
+	done
+
+	for bench in pack find_path read; do
+		grep -q "^$tree	mem	$bench	" bench.tsv
+	done
+done
+
+# only small files are pinned
+
+for tree in tiny wide deep; do
+	grep -q "^$tree	pread	pin	" bench.tsv
+done
+
+# success
+
+exit 0
@@ -18,6 +18,23 @@ truncate -s 128m root/dir/large_file
 
 iar --pack root --output packed.iar
 
+# packing with multiple threads should give the exact same result
+
+iar --pack root --threads 4 --output threaded.iar
+cmp packed.iar threaded.iar
+
+# same goes for writing the archive through a mapping
+
+iar --pack root --threads 4 --mmap --output mapped.iar
+cmp packed.iar mapped.iar
+
+# without threads, the size of the archive isn't known beforehand, so '--mmap' can't do anything & should say so
+
+if iar --pack root --mmap --output unmapped.iar 2> /dev/null; then
+	echo "'--mmap' was accepted without '--threads'" >&2
+	exit 1
+fi
+
 if [ "$(uname)" = "aquaBSD" ] || [ "$(uname)" = "FreeBSD" ]; then
 	# only on aquaBSD/FreeBSD because GNU 'du' doesn't support the -A flag
 
@@ -37,6 +54,236 @@ diff out/root/dir/test root/dir/test
 diff out/root/dir/bin root/dir/bin
 diff out/root/dir/large_file root/dir/large_file
 
+# list entries
+
+iar --list packed.iar > list
+
+grep -q "	6	second$" list
+grep -q "	$((30 + 134217728 + $(wc -c < root/dir/bin)))	dir/$" list
+grep -q "	134217728	dir/large_file$" list
+
+# extract only some entries
+
+iar --unpack packed.iar --extract dir --extract first --output extracted
+
+diff extracted/first root/first
+diff extracted/dir/test root/dir/test
+diff extracted/dir/large_file root/dir/large_file
+
+if [ -e extracted/second ]; then
+	exit 1
+fi
+
+# delta repack with the previous archive as a base
+# the source files still have the mtimes recorded for them in the base, so they're considered unchanged, except for the one we change
+
+echo "apples" > root/second
+
+iar --pack root --base packed.iar --output delta.iar
+iar --unpack delta.iar --output delta
+
+diff delta/root/first root/first
+diff delta/root/second root/second
+
+diff delta/root/dir/test root/dir/test
+diff delta/root/dir/bin root/dir/bin
+diff delta/root/dir/large_file root/dir/large_file
+
+# a file rewritten with the same size after its base was packed mustn't be reused, even if the base itself is newer (e.g. because it's been copied)
+
+mkdir -p stale
+echo "aaaa" > stale/file
+iar --pack stale --output stale.iar
+
+echo "bbbb" > stale/file
+sleep 1 # so that the copy is strictly newer, even going by seconds
+cp stale.iar stale_copy.iar
+
+iar --pack stale --base stale_copy.iar --output stale_delta.iar
+iar --unpack stale_delta.iar --output stale_out
+
+diff stale_out/stale/file stale/file
+
+# patch files in place (fits in the old content's slot) and by appending (larger than the page padding)
+
+echo "kiwi" > patch_small
+head -c 10000 libiar.so > patch_large
+
+cp packed.iar patched.iar
+
+iar --patch patched.iar --entry second --input patch_small
+
+if [ $(wc -c < patched.iar) -ne $(wc -c < packed.iar) ]; then
+	exit 1
+fi
+
+iar --patch patched.iar --entry dir/test --input patch_large
+
+iar --unpack patched.iar --output patched
+iar --list patched.iar > patched_list
+
+grep -q "	5	second$" patched_list
+grep -q "	$((10000 + 134217728 + $(wc -c < root/dir/bin)))	dir/$" patched_list
+
+diff patched/root/first out/root/first
+diff patched/root/second patch_small
+diff patched/root/dir/test patch_large
+diff patched/root/dir/bin out/root/dir/bin
+
+# content which shrunk in place can grow back into its slot later on (the old content's tail mustn't be left behind)
+
+head -c 100 libiar.so > patch_grown
+patched_bytes=$(wc -c < patched.iar)
+
+iar --patch patched.iar --entry first --input patch_small
+iar --patch patched.iar --entry first --input patch_grown
+
+if [ $(wc -c < patched.iar) -ne $patched_bytes ]; then
+	echo "Patching content which had shrunk in place appended it instead" >&2
+	exit 1
+fi
+
+iar --unpack patched.iar --extract first --output patched_grown
+diff patched_grown/first patch_grown
+
+# archives embedded in a larger file
+
+head -c 4096 libiar.so > embedded.bin
+cat packed.iar >> embedded.bin
+
+iar --list embedded.bin --offset 4096 > embedded_list
+iar --list packed.iar | diff - embedded_list
+
+iar --unpack embedded.bin --offset 4096 --output embedded
+diff -r out embedded
+
+# mmap I/O backend
+
+iar --unpack packed.iar --io mmap --output mmapped
+diff -r out mmapped
+
+iar --unpack embedded.bin --offset 4096 --io mmap --output embedded_mmapped
+diff -r out embedded_mmapped
+
+# io_uring I/O backend (if available)
+
+if iar --list packed.iar --io uring > /dev/null 2>&1; then
+	iar --pack root --output plain.iar # 'root' has been touched since 'packed.iar'
+	iar --pack root --io uring --output uring.iar
+	cmp plain.iar uring.iar
+
+	iar --unpack packed.iar --io uring --output uringed
+	diff -r out uringed
+fi
+
+# profile-guided layout
+# by default, 'dir' comes before 'second', so this should put 'second' first
+
+iar --unpack packed.iar --extract second --extract dir/bin --output traced --trace trace
+grep -q "^find	.*	second$" trace
+
+iar --pack root --layout trace --output laid_out.iar
+iar --list laid_out.iar > laid_out_list
+
+second_offset=$(grep "	second$" laid_out_list | cut -f1)
+bin_offset=$(grep "	dir/bin$" laid_out_list | cut -f1)
+large_offset=$(grep "	dir/large_file$" laid_out_list | cut -f1)
+
+if [ $second_offset -ge $bin_offset ] || [ $bin_offset -ge $large_offset ]; then
+	echo "Files weren't laid out in the order of the trace" >&2
+	exit 1
+fi
+
+iar --unpack laid_out.iar --output laid_out
+diff -r root laid_out/root
+
+# the file laid out after 'second' is in another directory, so patching 'second' mustn't grow into that file's node
+
+head -c 4090 libiar.so > patch_medium # just under a page
+cp laid_out.iar laid_out_patched.iar
+
+iar --patch laid_out_patched.iar --entry second --input patch_medium
+iar --unpack laid_out_patched.iar --output laid_out_patched
+
+diff laid_out_patched/root/second patch_medium
+diff laid_out_patched/root/dir/bin root/dir/bin
+
+# paths outside the tree (or which the walk otherwise never gets to) should be ignored rather than packed without being referenced
+
+cp trace escaping_trace
+printf "find	0	../trace
+read	0
+find	1	dir/../first
+read	1
+" >> escaping_trace
+
+iar --pack root --layout escaping_trace --output escaping.iar 2> /dev/null
+cmp laid_out.iar escaping.iar
+
+# failing to write out files (here because they're over the file size limit) should fail unpacking
+
+if (trap '' XFSZ; ulimit -f 64; iar --unpack packed.iar --output limited) 2> /dev/null; then
+	echo "Unpacking succeeded even though files couldn't be written out" >&2
+	exit 1
+fi
+
+# stats
+
+iar --unpack packed.iar --extract second --output stats_out --stats text 2> stats
+grep -q "^lookups	1$" stats
+grep -q "^bytes_read	[1-9]" stats
+
+iar --unpack packed.iar --extract second --output stats_json_out --stats json 2> stats.json
+grep -q '"lookups" *: *1,' stats.json
+grep -q '"unpack_data" *: *[0-9]' stats.json
+
+# running out of space partway through packing must fail the pack straight away
+# ('SIGXFSZ' is ignored, so that writes past the file size limit fail with 'EFBIG' instead)
+
+mkdir -p full
+
+for i in $(seq 1 300); do
+	head -c 2000 libiar.so > full/f$i
+done
+
+if sh -c "trap '' XFSZ; ulimit -f 100; iar --pack full --output full.iar" 2> full.err; then
+	echo "Packing past the file size limit succeeded" >&2
+	exit 1
+fi
+
+[ $(grep -c ERROR full.err) -eq 1 ]
+
+# very deep trees
+# (deep enough that their full paths are longer than 'PATH_MAX', so they have to be walked one directory at a time, both here & by IAR)
+
+mkdir -p deep
+(
+	cd deep
+
+	for i in $(seq 1 2500); do
+		echo $i > file
+		mkdir d
+		cd -P d # without following the logical path, which would get too long
+	done
+)
+
+iar --pack deep --output deep.iar
+iar --unpack deep.iar --output deep_out
+
+iar --pack deep --output deep_threads.iar --threads 4 # scanned in parallel, which must open directories relative to their parent too
+cmp deep.iar deep_threads.iar
+
+(
+	cd deep_out/deep
+
+	for i in $(seq 1 2500); do
+		[ "$(cat file)" = $i ]
+		cd -P d # without following the logical path, which would get too long
+	done
+
+	[ -z "$(ls)" ]
+)
+
 # success
 
 exit 0